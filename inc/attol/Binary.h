@@ -0,0 +1,553 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <utility>
+#include <memory>
+#include <atomic>
+#include <new>
+
+#include "attol/Utils.h"
+
+#ifndef WIN32
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+namespace attol {
+
+//! every vector of the binary format starts at a multiple of this, counted from the beginning of the format
+static const size_t binary_alignment = 64;
+
+inline size_t BinaryPadding(size_t position)
+{
+    return (binary_alignment - position % binary_alignment) % binary_alignment;
+}
+
+//! a vector which is either in the heap or in a read-only memory (like a mapped file)
+/*!
+    Reading it is like reading a std::vector.
+    Modifying a mapped one copies it into the heap first, so it has to be done before the memory is gone.
+*/
+template<class T>
+class MappedVector
+{
+public:
+    typedef T value_type;
+    MappedVector()
+        : first(nullptr), count(0), mapped(false)
+    {
+    }
+    MappedVector(const MappedVector& other)
+        : owned(other.owned), mapped(other.mapped)
+    {
+        Sync(other);
+    }
+    MappedVector(MappedVector&& other)
+        : owned(std::move(other.owned)), mapped(other.mapped)
+    {
+        Sync(other);
+        other.clear();
+    }
+    MappedVector& operator=(const MappedVector& other)
+    {
+        owned = other.owned;
+        mapped = other.mapped;
+        Sync(other);
+        return *this;
+    }
+    MappedVector& operator=(MappedVector&& other)
+    {
+        owned = std::move(other.owned);
+        mapped = other.mapped;
+        Sync(other);
+        other.clear();
+        return *this;
+    }
+    //! uses the memory [data, data + n) from now on, nothing is copied
+    void Map(const T* data, size_t n)
+    {
+        owned.clear();
+        owned.shrink_to_fit();
+        first = data;
+        count = n;
+        mapped = true;
+    }
+    bool IsMapped()const { return mapped; }
+
+    size_t size()const { return count; }
+    bool empty()const { return count == 0; }
+    const T* data()const { return first; }
+    const T* begin()const { return first; }
+    const T* end()const { return first + count; }
+    const T& operator[](size_t i)const { return first[i]; }
+    const T& back()const { return first[count - 1]; }
+
+    T* data() { Own(); return owned.data(); }
+    T* begin() { Own(); return owned.data(); }
+    T* end() { Own(); return owned.data() + owned.size(); }
+    T& operator[](size_t i) { Own(); return owned[i]; }
+
+    void clear()
+    {
+        owned.clear();
+        mapped = false;
+        Sync();
+    }
+    void resize(size_t n)
+    {
+        Own();
+        owned.resize(n);
+        Sync();
+    }
+    void resize(size_t n, const T& x)
+    {
+        Own();
+        owned.resize(n, x);
+        Sync();
+    }
+    void assign(size_t n, const T& x)
+    {
+        owned.assign(n, x);
+        mapped = false;
+        Sync();
+    }
+    void reserve(size_t n)
+    {
+        Own();
+        owned.reserve(n);
+        Sync();
+    }
+    void shrink_to_fit()
+    {
+        if (!mapped)
+            owned.shrink_to_fit();
+        Sync();
+    }
+    void push_back(const T& x)
+    {
+        Own();
+        owned.push_back(x);
+        Sync();
+    }
+    template<class... Args>
+    void emplace_back(Args&&... args)
+    {
+        Own();
+        owned.emplace_back(std::forward<Args>(args)...);
+        Sync();
+    }
+    template<class Iterator>
+    void insert(const T* position, Iterator b, Iterator e)
+    {
+        const size_t offset = position - first;
+        Own();
+        owned.insert(owned.begin() + offset, b, e);
+        Sync();
+    }
+    void swap(std::vector<T>& other)
+    {
+        Own();
+        owned.swap(other);
+        Sync();
+    }
+private:
+    void Own()
+    {
+        if (mapped)
+        {
+            owned.assign(first, first + count);
+            mapped = false;
+            Sync();
+        }
+    }
+    void Sync()
+    {
+        first = owned.data();
+        count = owned.size();
+    }
+    void Sync(const MappedVector& other)
+    {
+        if (mapped)
+        {
+            first = other.first;
+            count = other.count;
+        }
+        else
+            Sync();
+    }
+    std::vector<T> owned;
+    const T* first;
+    size_t count;
+    bool mapped;
+};
+
+//! copies between vectors of trivially copyable types with the same layout, like the nested types of two instantiations
+template<class To, class From>
+void CopyBinaryVector(MappedVector<To>& to, const MappedVector<From>& from)
+{
+    static_assert(IS_TRIVIALLY_COPYABLE(To) && IS_TRIVIALLY_COPYABLE(From) && sizeof(To) == sizeof(From), "");
+    to.clear();
+    to.resize(from.size());
+    if (!from.empty())
+        std::memcpy(to.data(), from.data(), sizeof(From) * from.size());
+}
+
+//! writes or reads the binary format to or from a file, the vectors are copied
+class BinaryFile
+{
+public:
+    //! the format starts where the file is now
+    explicit BinaryFile(FILE* f)
+        : f(f), position(0)
+    {
+    }
+    bool Read(void* p, size_t n)
+    {
+        const size_t result = fread(p, 1, n, f);
+        position += result;
+        return result == n;
+    }
+    bool Write(const void* p, size_t n)
+    {
+        const size_t result = fwrite(p, 1, n, f);
+        position += result;
+        return result == n;
+    }
+    template<class Type>
+    bool Read(Type& x)
+    {
+        static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
+        return Read(&x, sizeof(Type));
+    }
+    template<class Type>
+    bool Write(const Type& x)
+    {
+        static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
+        return Write(&x, sizeof(Type));
+    }
+    template<class Type>
+    bool ReadVector(MappedVector<Type>& v)
+    {
+        static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
+        size_t s;
+        if (!Read(s))
+            return false;
+        char padding[binary_alignment];
+        if (!Read(padding, Padding()))
+            return false;
+        v.clear();
+        v.resize(s);
+        return Read(v.data(), sizeof(Type) * s);
+    }
+    template<class Type>
+    bool WriteVector(const MappedVector<Type>& v)
+    {
+        static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
+        const size_t s = v.size();
+        if (!Write(s))
+            return false;
+        const char padding[binary_alignment] = {};
+        if (!Write(padding, Padding()))
+            return false;
+        return Write(v.data(), sizeof(Type) * s);
+    }
+private:
+    size_t Padding()const
+    {
+        return BinaryPadding(position);
+    }
+    FILE* f;
+    size_t position;
+};
+
+//! writes the binary format to the end of a buffer
+class BinaryBuffer
+{
+public:
+    //! the format starts where the buffer ends now
+    explicit BinaryBuffer(std::vector<char>& buffer)
+        : buffer(buffer), begin(buffer.size())
+    {
+    }
+    bool Write(const void* p, size_t n)
+    {
+        buffer.insert(buffer.end(), static_cast<const char*>(p), static_cast<const char*>(p) + n);
+        return true;
+    }
+    template<class Type>
+    bool Write(const Type& x)
+    {
+        static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
+        return Write(&x, sizeof(Type));
+    }
+    template<class Type>
+    bool WriteVector(const MappedVector<Type>& v)
+    {
+        static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
+        Write(v.size());
+        buffer.resize(buffer.size() + BinaryPadding(buffer.size() - begin), 0);
+        return Write(v.data(), sizeof(Type) * v.size());
+    }
+private:
+    std::vector<char>& buffer;
+    size_t begin;
+};
+
+//! reads the binary format from memory, the vectors point into the memory instead of being copied
+/*!
+    The memory has to be aligned to binary_alignment, like a mapped file is.
+*/
+class BinaryImage
+{
+public:
+    BinaryImage(const void* data, size_t size)
+        : begin(static_cast<const char*>(data)), size(size), position(0)
+    {
+    }
+    bool Read(void* p, size_t n)
+    {
+        if (n > size - position)
+            return false;
+        std::memcpy(p, begin + position, n);
+        position += n;
+        return true;
+    }
+    template<class Type>
+    bool Read(Type& x)
+    {
+        static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
+        return Read(&x, sizeof(Type));
+    }
+    template<class Type>
+    bool ReadVector(MappedVector<Type>& v)
+    {
+        static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
+        size_t s;
+        if (!Read(s))
+            return false;
+        position += BinaryPadding(position);
+        if (position > size || s > (size - position) / sizeof(Type))
+            return false;
+        const char* const p = begin + position;
+        if (reinterpret_cast<std::uintptr_t>(p) % alignof(Type) != 0)
+            return false;
+        v.Map(reinterpret_cast<const Type*>(p), s);
+        position += sizeof(Type) * s;
+        return true;
+    }
+private:
+    const char* begin;
+    size_t size;
+    size_t position;
+};
+
+//! in front of the binary format in a shared image, see MappedFile::OpenShared
+/*!
+    The binary format starts at binary_alignment, right after the header and the padding.
+*/
+struct SharedImageHeader
+{
+    //! "attol" and zeros
+    char magic[8];
+    //! the images which replace each other under the same name have increasing generations, zero while it is being written
+    std::atomic<std::uint64_t> generation;
+    //! of the binary format
+    std::uint64_t size;
+};
+static_assert(sizeof(SharedImageHeader) == 24, "the layout of the header is part of the shared image format");
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the generation is read and written by several processes, it has to be lock-free");
+
+//! a POSIX shared memory object is named like "/name", everything else is a file
+inline bool IsSharedMemoryName(const std::string& name)
+{
+    return name.size() > 1 && name[0] == '/' && name.find('/', 1) == std::string::npos;
+}
+
+//! a file or a shared memory object in memory, read-only, the processes which map the same one share its pages
+/*!
+    On Windows the file is simply read into the heap, and there are no shared memory objects.
+*/
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& filename)
+        : base(nullptr), mapped_size(0), data(nullptr), size(0), generation(0)
+    {
+        Open(filename);
+        data = base;
+        size = mapped_size;
+    }
+    //! maps the binary format in a shared image, see PublishShared
+    /*!
+        Throws if there is no image under the name, or if it is being written.
+    */
+    static std::shared_ptr<const MappedFile> OpenShared(const std::string& name)
+    {
+        std::shared_ptr<MappedFile> file(new MappedFile());
+        file->Open(name);
+        std::uint64_t generation, size;
+        if (file->mapped_size < binary_alignment || !ReadHeader(file->base, generation, size) ||
+            generation == 0 || size > file->mapped_size - binary_alignment)
+            throw Error("\"", name, "\" is not a complete transducer image!");
+        file->data = static_cast<const char*>(file->base) + binary_alignment;
+        file->size = size_t(size);
+        file->generation = generation;
+        return file;
+    }
+    //! the generation of the shared image under the name, zero if there is none or it is being written
+    /*!
+        A process can check this between two jobs and map the new image if it is newer than the one it has.
+    */
+    static std::uint64_t GetSharedGeneration(const std::string& name)
+    {
+        try
+        {
+            MappedFile file(name);
+            std::uint64_t generation, size;
+            return file.size >= binary_alignment && ReadHeader(file.data, generation, size) ? generation : 0;
+        }
+        catch (const Error&)
+        {
+            return 0;
+        }
+    }
+    //! puts a binary format under the name as a shared image with the next generation, which is returned
+    /*!
+        The processes which have mapped the previous image keep it until they unmap it.
+        A file is written next to the old one and renamed over it,
+        a shared memory object is replaced and its generation is set when it is complete.
+    */
+    static std::uint64_t PublishShared(const std::string& name, const std::vector<char>& format)
+    {
+        const std::uint64_t generation = GetSharedGeneration(name) + 1;
+        std::vector<char> image(binary_alignment + format.size(), 0);
+        // generation zero until the rest is there
+        SharedImageHeader* header = new (image.data()) SharedImageHeader();
+        std::memcpy(header->magic, "attol", 5);
+        header->size = format.size();
+        std::copy(format.begin(), format.end(), image.begin() + binary_alignment);
+#ifndef WIN32
+        if (IsSharedMemoryName(name))
+        {
+            // the old object is gone from the name, but not from the processes which have it mapped
+            shm_unlink(name.c_str());
+            const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+            if (fd < 0)
+                throw Error("Cannot create shared memory \"", name, "\"!");
+            void* p = MAP_FAILED;
+            if (ftruncate(fd, off_t(image.size())) == 0)
+                p = mmap(nullptr, image.size(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED)
+            {
+                shm_unlink(name.c_str());
+                throw Error("Cannot write shared memory \"", name, "\"!");
+            }
+            std::memcpy(p, image.data(), image.size());
+            static_cast<SharedImageHeader*>(p)->generation.store(generation, std::memory_order_release);
+            munmap(p, image.size());
+            return generation;
+        }
+#endif
+        header->generation.store(generation);
+        const std::string temporary = name + ".tmp";
+        FILE* f = fopen(temporary.c_str(), "wb");
+        if (!f)
+            throw Error("Cannot open \"", temporary, "\" for writing!");
+        const bool written = fwrite(image.data(), 1, image.size(), f) == image.size();
+        if (fclose(f) != 0 || !written)
+            throw Error("Cannot write \"", temporary, "\"!");
+#ifdef WIN32
+        // rename does not replace on Windows
+        remove(name.c_str());
+#endif
+        if (rename(temporary.c_str(), name.c_str()) != 0)
+            throw Error("Cannot rename \"", temporary, "\" to \"", name, "\"!");
+        return generation;
+    }
+    ~MappedFile()
+    {
+#ifndef WIN32
+        if (base)
+            munmap(base, mapped_size);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    const void* GetData()const { return data; }
+    size_t GetSize()const { return size; }
+    //! of the shared image, zero if this is not one
+    std::uint64_t GetGeneration()const { return generation; }
+private:
+    MappedFile()
+        : base(nullptr), mapped_size(0), data(nullptr), size(0), generation(0)
+    {
+    }
+    //! the generation is read first, it is set the last, so the rest is complete if it is not zero
+    static bool ReadHeader(const void* p, std::uint64_t& generation, std::uint64_t& size)
+    {
+        const SharedImageHeader* header = static_cast<const SharedImageHeader*>(p);
+        generation = header->generation.load(std::memory_order_acquire);
+        size = header->size;
+        return std::memcmp(header->magic, "attol\0\0\0", sizeof(header->magic)) == 0;
+    }
+    void Open(const std::string& name)
+    {
+#ifdef WIN32
+        FILE* f = fopen(name.c_str(), "rb");
+        if (!f)
+            throw Error("Cannot open \"", name, "\"!");
+        char chunk[1 << 16];
+        size_t n;
+        std::vector<char> content;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+            content.insert(content.end(), chunk, chunk + n);
+        fclose(f);
+        // uint64_t for the alignment
+        buffer.resize(content.size() / sizeof(std::uint64_t) + 1);
+        std::memcpy(buffer.data(), content.data(), content.size());
+        base = buffer.data();
+        mapped_size = content.size();
+#else
+        const int fd = IsSharedMemoryName(name) ? shm_open(name.c_str(), O_RDONLY, 0) : open(name.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw Error("Cannot open \"", name, "\"!");
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            throw Error("Cannot stat \"", name, "\"!");
+        }
+        mapped_size = size_t(st.st_size);
+        if (mapped_size > 0)
+        {
+            void* p = mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                close(fd);
+                throw Error("Cannot map \"", name, "\" into memory!");
+            }
+            base = p;
+        }
+        close(fd);
+#endif
+    }
+    //! what is mapped
+    void* base;
+    size_t mapped_size;
+    //! what is used of it
+    const void* data;
+    size_t size;
+    std::uint64_t generation;
+#ifdef WIN32
+    std::vector<std::uint64_t> buffer;
+#endif
+};
+
+}
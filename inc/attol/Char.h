@@ -5,6 +5,7 @@
 #include <vector>
 #include <array>
 #include <string>
+#include <limits>
 
 namespace attol {
 
@@ -83,6 +84,45 @@ const typename CodeUnit<e>::type* GetNextCharacter(const typename CodeUnit<e>::t
     return StepNextCharacter<e>(word);
 }
 
+//! the code point of one character, which is [begin, end) according to StepNextCharacter
+/*!
+    Returns false for malformed and overlong sequences, so that different characters never get the same code point.
+*/
+template<Encoding e>
+bool DecodeCharacter(const typename CodeUnit<e>::type* begin, const typename CodeUnit<e>::type* end, std::uint32_t& code_point) noexcept
+{
+    typedef typename std::make_unsigned<typename CodeUnit<e>::type>::type Unit;
+    const auto length = end - begin;
+    const std::uint32_t first = Unit(begin[0]);
+    switch (e)
+    {
+    case Encoding::UTF8:
+        // the continuation bytes are checked by StepNextCharacter already
+        if (length == 1 && first < 0x80)
+            code_point = first;
+        else if (length == 2 && (first & 0xE0) == 0xC0)
+            code_point = ((first & 0x1F) << 6) | (Unit(begin[1]) & 0x3F);
+        else if (length == 3 && (first & 0xF0) == 0xE0)
+            code_point = ((first & 0x0F) << 12) | ((Unit(begin[1]) & 0x3F) << 6) | (Unit(begin[2]) & 0x3F);
+        else if (length == 4 && (first & 0xF8) == 0xF0)
+            code_point = ((first & 0x07) << 18) | ((Unit(begin[1]) & 0x3F) << 12) | ((Unit(begin[2]) & 0x3F) << 6) | (Unit(begin[3]) & 0x3F);
+        else
+            return false;
+        return code_point >= (length == 1 ? 0 : length == 2 ? 0x80 : length == 3 ? 0x800 : 0x10000);
+    case Encoding::UTF16:
+        if (length == 1)
+            code_point = first;
+        else if (length == 2 && (Unit(begin[1]) & 0xFC00) == 0xDC00)
+            code_point = 0x10000 + (((first & 0x3FF) << 10) | (Unit(begin[1]) & 0x3FF));
+        else
+            return false;
+        return true;
+    default:
+        code_point = first;
+        return length == 1;
+    }
+}
+
 template<class CharType, class StorageType>
 bool StrEnds(StorageType word) noexcept
 {
@@ -169,7 +209,7 @@ bool ReadFloat(const CharType* s, ResultType& x)
 template<class CharType, class FloatType>
 std::basic_string<CharType> WriteFloat(FloatType&& x)
 {
-    static char result[32];
+    char result[32];
     std::snprintf(result, 32, "%g", x);
     return Convert<CharType>(result);
 }
@@ -184,10 +224,67 @@ bool ReadIndex(const CharType* s, Index& i)
         ), &i);
 }
 
+//! like ReadIndex, but on [begin, end) and without a copy if it starts with a decimal digit
+template<class CharType, class Index>
+bool ParseIndex(const CharType* begin, const CharType* end, Index& i)
+{
+    Index x = 0;
+    const CharType* s = begin;
+    for (; s != end && *s >= CharType('0') && *s <= CharType('9'); ++s)
+    {
+        const Index digit = Index(*s - CharType('0'));
+        if (x > (std::numeric_limits<Index>::max() - digit) / 10)
+            break;
+        x = 10 * x + digit;
+    }
+    if (s == begin || (s != end && *s >= CharType('0') && *s <= CharType('9')))
+        // a sign, whitespace or an overflow
+        return ReadIndex(std::basic_string<CharType>(begin, end).c_str(), i);
+    i = x;
+    return true;
+}
+
+//! like ReadFloat, but on [begin, end) and without a copy for the plain decimals, the decimal point is always '.'
+/*!
+    If the digits and the power of ten are both exact in Float, one division rounds correctly,
+    so the result is the same as with ReadFloat. The rest goes to ReadFloat.
+*/
+template<class CharType, class Float>
+bool ParseFloat(const CharType* begin, const CharType* end, Float& x)
+{
+    static_assert(std::is_floating_point<Float>::value, "");
+    static const Float powers[] = { Float(1e0), Float(1e1), Float(1e2), Float(1e3), Float(1e4), Float(1e5),
+        Float(1e6), Float(1e7), Float(1e8), Float(1e9), Float(1e10), Float(1e11), Float(1e12), Float(1e13),
+        Float(1e14), Float(1e15), Float(1e16), Float(1e17), Float(1e18), Float(1e19), Float(1e20), Float(1e21), Float(1e22) };
+    // the largest exact power of ten: 5^10 < 2^24, 5^22 < 2^53
+    const int max_power = std::numeric_limits<Float>::digits < 53 ? 10 : 22;
+    const std::uint64_t max_mantissa = std::uint64_t(1) << (std::numeric_limits<Float>::digits < 64 ? std::numeric_limits<Float>::digits : 63);
+    const CharType* s = begin;
+    const bool negative = s != end && *s == CharType('-');
+    if (s != end && (*s == CharType('-') || *s == CharType('+')))
+        ++s;
+    std::uint64_t mantissa = 0;
+    int power = 0;
+    bool digits = false, exact = true;
+    for (; s != end && *s >= CharType('0') && *s <= CharType('9'); ++s, digits = true)
+        exact = exact && (mantissa = 10 * mantissa + std::uint64_t(*s - CharType('0'))) <= max_mantissa;
+    if (s != end && *s == CharType('.'))
+        for (++s; s != end && *s >= CharType('0') && *s <= CharType('9'); ++s, digits = true, --power)
+            exact = exact && (mantissa = 10 * mantissa + std::uint64_t(*s - CharType('0'))) <= max_mantissa;
+    // exponent, hexadecimal, inf and nan
+    if (!exact || !digits || -power > max_power ||
+        (s != end && (*s == CharType('e') || *s == CharType('E') || *s == CharType('x') || *s == CharType('X'))))
+        return ReadFloat(std::basic_string<CharType>(begin, end).c_str(), x);
+    x = Float(mantissa) / powers[-power];
+    if (negative)
+        x = -x;
+    return true;
+}
+
 template<class CharType, class Index>
 std::basic_string<CharType> WriteIndex(Index&& x)
 {
-    static char result[32];
+    char result[32];
     std::snprintf(result, 32, "%llu", static_cast<unsigned long long>(x));
     return Convert<CharType>(result);
 }
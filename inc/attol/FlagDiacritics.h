@@ -9,6 +9,7 @@
 #include <climits>
 
 #include <attol/Utils.h>
+#include <attol/Binary.h>
 
 namespace attol {
 
@@ -66,18 +67,18 @@ public:
         op_map[flag_id].assign(flags);
         flag_symbol_min = std::min(flag_symbol_min, flag_id);
     }
+    //! the output of a flag diacritic transition is the index of its operation, they are in a side table
     template<class Type>
     void Compile(Type flag_id, Type& output)const
     {
-        static_assert(sizeof(Operation) <= sizeof(Type), "");
-        reinterpret_cast<Operation&>(output) = operations[flag_id - flag_symbol_min];
+        output = flag_id - flag_symbol_min;
     }
 
     // if false, then state is not modified,
     // if true, then operation is applied to the state 
     bool Apply(const Index& id, State& state)const
     {
-        const auto& op = reinterpret_cast<const Operation&>(id);
+        const auto& op = operations[id];
         const unsigned char bit_start = offsets[op.feature - 1];
         const unsigned char bit_end = offsets[op.feature];
         const auto current_value = state.Get(bit_start, bit_end);
@@ -147,6 +148,7 @@ public:
                 " bits, but FlagDiacritics::State is only ", sizeof(StorageType) * CHAR_BIT, " bits wide!");
         offsets.emplace_back(bits);
 
+        const auto numbers = GetFeatureValues();
         operations.clear();
         operations.resize(op_map.size());
         for (const auto& op : op_map)
@@ -154,28 +156,30 @@ public:
             Operation& newop = operations[op.first - flag_symbol_min];
             newop.type = (char)(op.second[1]);
             const auto p = Parse(op.second.c_str());
-            const auto b = GetFeatureValue(p.first.c_str(), p.second.c_str());
-            newop.feature = b.first;
-            newop.value = b.second;
+            const auto& feature = numbers.at(p.first);
+            newop.feature = feature.first;
+            newop.value = p.second.empty() ? 0 : feature.second.at(p.second);
         }
     }
-    bool Write(FILE* f)const
+    template<class Output>
+    bool Write(Output& out)const
     {
-        if (fwrite(&flag_symbol_min, sizeof(flag_symbol_min), 1, f) != 1)
+        if (!out.Write(flag_symbol_min))
             return false;
-        if (!WriteBinaryVector(f, offsets))
+        if (!out.WriteVector(offsets))
             return false;
-        if (!WriteBinaryVector(f, operations))
+        if (!out.WriteVector(operations))
             return false;
         return true;
     }
-    bool Read(FILE* f)
+    template<class Input>
+    bool Read(Input& in)
     {
-        if (fread(&flag_symbol_min, sizeof(flag_symbol_min), 1, f) != 1)
+        if (!in.Read(flag_symbol_min))
             return false;
-        if (!ReadBinaryVector(f, offsets))
+        if (!in.ReadVector(offsets))
             return false;
-        if (!ReadBinaryVector(f, operations))
+        if (!in.ReadVector(operations))
             return false;
         return true;
     }
@@ -199,40 +203,27 @@ private:
         return p;
     }
     // typedef typename std::make_unsigned<CharType>::type UCharType;
-    std::pair<unsigned char, unsigned char> GetFeatureValue(ccstr feature, ccstr value)const
+    //! the features and their values are numbered from 1 in the order of flag_map, the empty value is 0
+    std::unordered_map<string, std::pair<unsigned char, std::unordered_map<string, unsigned char>>> GetFeatureValues()const
     {
-        std::pair<unsigned char, unsigned char> p((unsigned char)1, (unsigned char)0);
-        for (auto& f : flag_map)
+        std::unordered_map<string, std::pair<unsigned char, std::unordered_map<string, unsigned char>>> numbers;
+        unsigned char feature = 1;
+        for (const auto& f : flag_map)
         {
-            if (f.first == feature)
-            {
-                if (value[0]) // not empty value
-                {
-                    p.second = 1;
-                    for (auto& v : f.second)
-                    {
-                        if (v == value)
-                        {
-                            return p;
-                        }
-                        ++p.second;
-                    }
-                }
-                else
-                {
-                    return p;
-                }
-            }
-            ++p.first;
+            auto& number = numbers[f.first];
+            number.first = feature++;
+            unsigned char value = 1;
+            for (const auto& v : f.second)
+                number.second.emplace(v, value++);
         }
-        throw Error("Oops!");
+        return numbers;
     }
 private:
     std::unordered_map<string, std::unordered_set<string>> flag_map;
     std::unordered_map<Index, string> op_map;
     typename std::make_unsigned<StorageType>::type flag_symbol_min;
-    std::vector<Operation> operations;
-    std::vector<unsigned char> offsets;
+    MappedVector<Operation> operations;
+    MappedVector<unsigned char> offsets;
 };
 
 }
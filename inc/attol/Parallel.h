@@ -0,0 +1,188 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <vector>
+#include <exception>
+#include <utility>
+#include <atomic>
+#include <algorithm>
+
+namespace attol {
+
+//! calls work(i) for every i in [0, n) on n_threads threads, including the calling one
+/*!
+    The indices are handed out one by one, in no particular order.
+    If work throws then the remaining indices are skipped and the first exception is re-thrown.
+*/
+template<class Worker>
+void ParallelFor(size_t n_threads, size_t n, Worker work)
+{
+    std::atomic<size_t> next(0);
+    std::mutex mutex;
+    std::exception_ptr error;
+    auto run = [&]()
+    {
+        try
+        {
+            for (size_t i; (i = next++) < n; )
+                work(i);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+                error = std::current_exception();
+            next = n;
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < std::min(n_threads, n); ++i)
+        threads.emplace_back(run);
+    run();
+    for (auto& thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+//! processes a stream of jobs on several threads, but hands over the results in the original order
+/*!
+    - read(Job&) is called on the calling thread until it returns false,
+    - work(thread_index, Job&, Result&) is called on one of the n_threads worker threads,
+    - write(Result&) is called on a separate thread, in the order the jobs were read.
+
+    At most max_pending jobs are read but not yet written at any time.
+    If any of the three throws then the processing stops and the first exception is re-thrown.
+*/
+template<class Job, class Result, class Reader, class Worker, class Writer>
+void OrderedParallel(size_t n_threads, size_t max_pending, Reader read, Worker work, Writer write)
+{
+    std::mutex mutex;
+    std::condition_variable job_available, result_available, space_available;
+    std::deque<std::pair<size_t, Job>> jobs;
+    std::map<size_t, Result> results;
+    size_t n_read = 0, pending = 0;
+    bool reading_done = false, abort = false;
+    std::exception_ptr error;
+
+    auto fail = [&]()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error)
+                error = std::current_exception();
+            abort = true;
+        }
+        job_available.notify_all();
+        result_available.notify_all();
+        space_available.notify_all();
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < n_threads; ++t)
+    {
+        workers.emplace_back([&, t]()
+        {
+            try
+            {
+                while (true)
+                {
+                    std::pair<size_t, Job> job;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        job_available.wait(lock, [&]() { return abort || reading_done || !jobs.empty(); });
+                        if (abort || jobs.empty())
+                            return;
+                        job = std::move(jobs.front());
+                        jobs.pop_front();
+                    }
+                    Result result;
+                    work(t, job.second, result);
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        results.emplace(job.first, std::move(result));
+                    }
+                    result_available.notify_all();
+                }
+            }
+            catch (...)
+            {
+                fail();
+            }
+        });
+    }
+    std::thread writer([&]()
+    {
+        try
+        {
+            for (size_t next = 0; ; ++next)
+            {
+                Result result;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    result_available.wait(lock, [&]()
+                    {
+                        return abort || results.find(next) != results.end() || (reading_done && next == n_read);
+                    });
+                    const auto it = results.find(next);
+                    if (abort || it == results.end())
+                        return;
+                    result = std::move(it->second);
+                    results.erase(it);
+                }
+                write(result);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    --pending;
+                }
+                space_available.notify_one();
+            }
+        }
+        catch (...)
+        {
+            fail();
+        }
+    });
+    try
+    {
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                space_available.wait(lock, [&]() { return abort || pending < max_pending; });
+                if (abort)
+                    break;
+            }
+            Job job;
+            if (!read(job))
+                break;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobs.emplace_back(n_read++, std::move(job));
+                ++pending;
+            }
+            job_available.notify_one();
+        }
+    }
+    catch (...)
+    {
+        fail();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        reading_done = true;
+    }
+    job_available.notify_all();
+    result_available.notify_all();
+    for (auto& worker : workers)
+        worker.join();
+    writer.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+}
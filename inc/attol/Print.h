@@ -11,15 +11,15 @@
 
 namespace attol {
 
-template<Encoding enc, size_t storageSize>
+template<Encoding enc, size_t storageSize, Layout layout = ARRAY_OF_STRUCTS>
 class PrintFunction
 {
 private:
-    typedef Transducer<enc, storageSize> T;
+    typedef Transducer<enc, storageSize, layout> T;
     Handlers<typename T::Path> f;
     typedef std::char_traits<typename T::CharType> CharTraits;
     
-    FILE* output;
+    typename T::string output;
     const typename T::CharType newline;
     const typename T::CharType input_separator;
     const typename T::CharType field_separator;
@@ -30,8 +30,21 @@ private:
     std::vector<typename T::Float> weights;
     const typename T::CharType* original_word;
 public:
-    PrintFunction(int print, FILE* o)
-    :   output(o), 
+    //! what is printed about a word, see Swap
+    struct WordState
+    {
+        WordState()
+            : original_word(nullptr), has_analyses(false)
+        {
+        }
+        typename T::string output;
+        std::vector<typename T::string> results;
+        std::vector<typename T::Float> weights;
+        const typename T::CharType* original_word;
+        bool has_analyses;
+    };
+    PrintFunction(int print)
+    :   output(), 
         newline('\n'), input_separator('|'), field_separator('\t'),
         has_analyses(false), print_at_end(false)
     {
@@ -59,7 +72,7 @@ public:
                 {
                     if (original_word)
                     {
-                        fwrite(original_word, sizeof(newline), CharTraits::length(original_word), output);
+                        output.append(original_word, CharTraits::length(original_word));
                     }
                 };
             }
@@ -82,18 +95,18 @@ public:
                 if (print_at_end)
                     f += [this](const typename T::Path&) {results.back() += field_separator; };
                 else
-                    f += [this](const typename T::Path&) {fwrite(&field_separator, sizeof(field_separator), 1, output); };
+                    f += [this](const typename T::Path&) {output.push_back(field_separator); };
             }
             if (print_input > 0 && !print_at_end)
             {
                 f += [this](const typename T::Path& path)
                 {
                     auto it = path.begin();
-                    fwrite(it->GetInput(), sizeof(newline), CharTraits::length(it->GetInput()), output);
+                    output.append(it->GetInput(), CharTraits::length(it->GetInput()));
                     for (++it; it != path.end(); ++it)
                     {
-                        fwrite(&input_separator, sizeof(input_separator), 1, output);
-                        fwrite(it->GetInput(), sizeof(newline), CharTraits::length(it->GetInput()), output);
+                        output.push_back(input_separator);
+                        output.append(it->GetInput(), CharTraits::length(it->GetInput()));
                     }
                 };
             }
@@ -103,12 +116,12 @@ public:
                 {
                     auto it = path.begin();
                     if (!T::FlagDiacriticsType::IsIt(it->GetInput()))
-                        fwrite(it->GetInput(), sizeof(newline), CharTraits::length(it->GetInput()), output);
+                        output.append(it->GetInput(), CharTraits::length(it->GetInput()));
                     for (++it; it != path.end(); ++it)
                     {
-                        fwrite(&input_separator, sizeof(input_separator), 1, output);
+                        output.push_back(input_separator);
                         if (!T::FlagDiacriticsType::IsIt(it->GetInput()))
-                            fwrite(it->GetInput(), sizeof(newline), CharTraits::length(it->GetInput()), output);
+                            output.append(it->GetInput(), CharTraits::length(it->GetInput()));
                     }
                 };
             }
@@ -149,7 +162,7 @@ public:
                 if (print_at_end)
                     f += [this](const typename T::Path&) {results.back() += field_separator; };
                 else
-                    f += [this](const typename T::Path&) {fwrite(&field_separator, sizeof(field_separator), 1, output); };
+                    f += [this](const typename T::Path&) {output.push_back(field_separator); };
             }
             if (print_output > 0 && !print_at_end)
             {
@@ -158,7 +171,7 @@ public:
                     for (const auto& v : path)
                     {
                         const auto output_s = v.GetOutput();
-                        fwrite(output_s, sizeof(newline), CharTraits::length(output_s), output);
+                        output.append(output_s, CharTraits::length(output_s));
                     }
                 };
             }
@@ -169,7 +182,7 @@ public:
                     for (const auto& v : path)
                     {
                         const auto output_s = v.InterpretOutput();
-                        fwrite(output_s, sizeof(newline), CharTraits::length(output_s), output);
+                        output.append(output_s, CharTraits::length(output_s));
                     }
                 };
             }
@@ -202,7 +215,7 @@ public:
                 if (print_at_end)
                     f += [this](const typename T::Path&) {results.back() += field_separator; };
                 else
-                    f += [this](const typename T::Path&) {fwrite(&field_separator, sizeof(field_separator), 1, output); };
+                    f += [this](const typename T::Path&) {output.push_back(field_separator); };
             }
             if (print_at_end)
             {
@@ -221,16 +234,14 @@ public:
             {
                 f += [this](const typename T::Path& path)
                 {
-                    static typename T::string index_s;
                     auto it = path.begin();
-                    index_s.clear();
-                    index_s = attol::WriteIndex<typename T::CharType>(it->GetId() + 1);
-                    fwrite(index_s.c_str(), sizeof(newline), index_s.size(), output);
+                    auto index_s = attol::WriteIndex<typename T::CharType>(it->GetId() + 1);
+                    output += index_s;
                     for (++it; it != path.end(); ++it)
                     {
-                        fwrite(&input_separator, sizeof(input_separator), 1, output);
+                        output.push_back(input_separator);
                         index_s = attol::WriteIndex<typename T::CharType>(it->GetId() + 1);
-                        fwrite(index_s.c_str(), sizeof(newline), index_s.size(), output);
+                        output += index_s;
                     }
                 };
             }
@@ -241,13 +252,11 @@ public:
             {
                 f += [this](const typename T::Path& path)
                 {
-                    static typename T::string weight_s;
                     typename T::Float weight = 0;
-                    weight_s.clear();
                     for (const auto& v : path)
                         weight += v.GetWeight();
-                    weight_s = WriteFloat<typename T::CharType>(weight);
-                    fwrite(weight_s.c_str(), sizeof(newline), weight_s.size(), output);
+                    const auto weight_s = WriteFloat<typename T::CharType>(weight);
+                    output += weight_s;
                 };
             }
             else if (print_weight > 0 && !is_first)
@@ -258,8 +267,8 @@ public:
                     for (const auto& v : path)
                         weight += v.GetWeight();
                     const auto weight_s = WriteFloat<typename T::CharType>(weight);
-                    fwrite(&field_separator, sizeof(field_separator), 1, output);
-                    fwrite(weight_s.c_str(), sizeof(newline), weight_s.size(), output);
+                    output.push_back(field_separator);
+                    output += weight_s;
                 };
             }
             else if (print_weight < 0 && is_first)
@@ -285,18 +294,28 @@ public:
             }
         }
         if (!print_at_end)
-            f += [this](const typename T::Path&) { fwrite(&newline, sizeof(newline), 1, output); };
+            f += [this](const typename T::Path&) { output.push_back(newline); };
     }
     void Reset(const typename T::CharType* original = nullptr)
     {
         has_analyses = false; 
         original_word = original;
+        output.clear();
         if (print_at_end)
         {
             results.clear();
             weights.clear();
         }
     }
+    //! exchanges the word which is printed with another one, so that the paths of several words can be printed in turns
+    void Swap(WordState& word)
+    {
+        output.swap(word.output);
+        results.swap(word.results);
+        weights.swap(word.weights);
+        std::swap(original_word, word.original_word);
+        std::swap(has_analyses, word.has_analyses);
+    }
     bool Succeeded()
     {
         if (print_at_end)
@@ -310,8 +329,8 @@ public:
                 w -= max_weight;
             }
             weight_s = WriteFloat<typename T ::CharType>(total_weight);
-            fwrite(weight_s.c_str(), sizeof(newline), weight_s.size(), output);
-            fwrite(&newline, sizeof(newline), 1, output);
+            output += weight_s;
+            output.push_back(newline);
 
             total_weight = 0;
             for (auto& w : weights)
@@ -320,15 +339,101 @@ public:
             }
             for (size_t i = 0; i < results.size(); ++i)
             {
-                fwrite(results[i].c_str(), sizeof(newline), results[i].size(), output);
+                output += results[i];
                 weight_s = WriteFloat<typename T::CharType>(100 * std::exp(weights[i]) / total_weight);
-                fwrite(weight_s.c_str(), sizeof(newline), weight_s.size(), output);
-                fwrite(&newline, sizeof(newline), 1, output);
+                output += weight_s;
+                output.push_back(newline);
             }
         }
         return has_analyses; 
     }
+    //! one field of a --print bitfield, in compile time
+    static constexpr int Field(int print, int i)
+    {
+        return ((print >> i) & 3) >= 2 ? ((print >> i) & 3) - 4 : ((print >> i) & 3);
+    }
+    //! prints a path exactly like the handlers in GetF() do, but the fields are known in compile time
+    /*!
+        Relative weights are not supported, because those need all the paths of a word.
+    */
+    template<int print>
+    void Print(const typename T::Path& path)
+    {
+        static_assert(Field(print, 8) >= 0, "relative weights can only be printed by the handlers of GetF()");
+        has_analyses = true;
+        bool is_first = true;
+        if (Field(print, 0))
+        {
+            if (original_word)
+                output.append(original_word, CharTraits::length(original_word));
+            is_first = false;
+        }
+        if (Field(print, 2))
+        {
+            if (!is_first)
+                output.push_back(field_separator);
+            for (auto it = path.begin(); it != path.end(); ++it)
+            {
+                if (it != path.begin())
+                    output.push_back(input_separator);
+                if (Field(print, 2) > 0 || !T::FlagDiacriticsType::IsIt(it->GetInput()))
+                    output.append(it->GetInput(), CharTraits::length(it->GetInput()));
+            }
+            is_first = false;
+        }
+        if (Field(print, 4))
+        {
+            if (!is_first)
+                output.push_back(field_separator);
+            for (const auto& v : path)
+            {
+                const auto output_s = Field(print, 4) > 0 ? v.GetOutput() : v.InterpretOutput();
+                output.append(output_s, CharTraits::length(output_s));
+            }
+            is_first = false;
+        }
+        if (Field(print, 6))
+        {   // this field does not count in is_first, same as in the handlers
+            if (!is_first)
+                output.push_back(field_separator);
+            for (auto it = path.begin(); it != path.end(); ++it)
+            {
+                if (it != path.begin())
+                    output.push_back(input_separator);
+                output += attol::WriteIndex<typename T::CharType>(it->GetId() + 1);
+            }
+        }
+        if (Field(print, 8))
+        {
+            typename T::Float weight = 0;
+            for (const auto& v : path)
+                weight += v.GetWeight();
+            if (!is_first)
+                output.push_back(field_separator);
+            output += WriteFloat<typename T::CharType>(weight);
+        }
+        output.push_back(newline);
+    }
     Handlers<typename T::Path>& GetF() { return f; }
+    //! what has been printed since the last Reset
+    typename T::string& GetOutput() { return output; }
+};
+
+//! hands the paths to PrintFunction::Print<print>, to be used as the sink of Transducer::Lookup
+template<Encoding enc, size_t storageSize, int print, Layout layout = ARRAY_OF_STRUCTS>
+class PrintSink
+{
+public:
+    explicit PrintSink(PrintFunction<enc, storageSize, layout>& printer)
+        : printer(printer)
+    {
+    }
+    void operator()(const typename Transducer<enc, storageSize, layout>::Path& path)
+    {
+        printer.template Print<print>(path);
+    }
+private:
+    PrintFunction<enc, storageSize, layout>& printer;
 };
 
 }
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+# define ATTOL_SIMD_X86
+# include <immintrin.h>
+#endif
+
+namespace attol {
+
+enum SimdLevel
+{
+    SCALAR,
+    SSE2,
+    AVX2
+};
+
+//! the best instruction set which this CPU supports, checked once
+inline SimdLevel GetSimdLevel()
+{
+#ifdef ATTOL_SIMD_X86
+    static const SimdLevel level = __builtin_cpu_supports("avx2") ? AVX2 : (__builtin_cpu_supports("sse2") ? SSE2 : SCALAR);
+    return level;
+#else
+    return SCALAR;
+#endif
+}
+
+//! counts the elements of data[0, n) which are greater than x and which are equal to x
+template<class Index>
+void CountGreaterEqualScalar(const Index* data, size_t n, Index x, size_t& greater, size_t& equal)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        greater += data[i] > x;
+        equal += data[i] == x;
+    }
+}
+
+#ifdef ATTOL_SIMD_X86
+// SSE2 and AVX2 have signed comparisons only, flipping the sign bit makes them unsigned
+__attribute__((target("sse2")))
+inline void CountGreaterEqualSse2(const std::uint32_t* data, size_t n, std::uint32_t x, size_t& greater, size_t& equal)
+{
+    const __m128i sign = _mm_set1_epi32(int(0x80000000u));
+    const __m128i vx = _mm_xor_si128(_mm_set1_epi32(int(x)), sign);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        const __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data + i)), sign);
+        greater += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, vx))));
+        equal += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, vx))));
+    }
+    CountGreaterEqualScalar(data + i, n - i, x, greater, equal);
+}
+
+__attribute__((target("avx2")))
+inline void CountGreaterEqualAvx2(const std::uint32_t* data, size_t n, std::uint32_t x, size_t& greater, size_t& equal)
+{
+    const __m256i sign = _mm256_set1_epi32(int(0x80000000u));
+    const __m256i vx = _mm256_xor_si256(_mm256_set1_epi32(int(x)), sign);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(data + i)), sign);
+        greater += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, vx))));
+        equal += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, vx))));
+    }
+    CountGreaterEqualScalar(data + i, n - i, x, greater, equal);
+}
+
+// the byte masks have two bits per 16-bit element
+__attribute__((target("sse2")))
+inline void CountGreaterEqualSse2(const std::uint16_t* data, size_t n, std::uint16_t x, size_t& greater, size_t& equal)
+{
+    const __m128i sign = _mm_set1_epi16(short(0x8000));
+    const __m128i vx = _mm_xor_si128(_mm_set1_epi16(short(x)), sign);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(data + i)), sign);
+        greater += __builtin_popcount(_mm_movemask_epi8(_mm_cmpgt_epi16(v, vx))) / 2;
+        equal += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi16(v, vx))) / 2;
+    }
+    CountGreaterEqualScalar(data + i, n - i, x, greater, equal);
+}
+
+__attribute__((target("avx2")))
+inline void CountGreaterEqualAvx2(const std::uint16_t* data, size_t n, std::uint16_t x, size_t& greater, size_t& equal)
+{
+    const __m256i sign = _mm256_set1_epi16(short(0x8000));
+    const __m256i vx = _mm256_xor_si256(_mm256_set1_epi16(short(x)), sign);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(data + i)), sign);
+        greater += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpgt_epi16(v, vx))) / 2;
+        equal += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, vx))) / 2;
+    }
+    CountGreaterEqualScalar(data + i, n - i, x, greater, equal);
+}
+#endif
+
+//! counts the elements of data[0, n) which are greater than x and which are equal to x
+/*!
+    With SSE2 or AVX2 if the CPU has it, only for 16-bit and 32-bit elements.
+*/
+template<class Index>
+void CountGreaterEqual(const Index* data, size_t n, Index x, size_t& greater, size_t& equal)
+{
+    greater = equal = 0;
+    CountGreaterEqualScalar(data, n, x, greater, equal);
+}
+
+inline void CountGreaterEqual(const std::uint32_t* data, size_t n, std::uint32_t x, size_t& greater, size_t& equal)
+{
+    greater = equal = 0;
+#ifdef ATTOL_SIMD_X86
+    switch (GetSimdLevel())
+    {
+    case AVX2:
+        return CountGreaterEqualAvx2(data, n, x, greater, equal);
+    case SSE2:
+        return CountGreaterEqualSse2(data, n, x, greater, equal);
+    default:
+        break;
+    }
+#endif
+    CountGreaterEqualScalar(data, n, x, greater, equal);
+}
+
+inline void CountGreaterEqual(const std::uint16_t* data, size_t n, std::uint16_t x, size_t& greater, size_t& equal)
+{
+    greater = equal = 0;
+#ifdef ATTOL_SIMD_X86
+    switch (GetSimdLevel())
+    {
+    case AVX2:
+        return CountGreaterEqualAvx2(data, n, x, greater, equal);
+    case SSE2:
+        return CountGreaterEqualSse2(data, n, x, greater, equal);
+    default:
+        break;
+    }
+#endif
+    CountGreaterEqualScalar(data, n, x, greater, equal);
+}
+
+}
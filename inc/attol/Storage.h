@@ -0,0 +1,279 @@
+#pragma once
+
+#include <vector>
+#include <cstdio>
+#include <limits>
+#include <cstdint>
+
+#include "attol/Utils.h"
+#include "attol/Binary.h"
+
+namespace attol {
+
+//! how Transducer stores its transitions
+enum Layout
+{
+    //! one record per transition
+    ARRAY_OF_STRUCTS,
+    //! the fields which are read on every probe are apart from the ones which are read only on a match
+    HOT_COLD,
+    //! like HOT_COLD, but without weights, every weight is zero
+    UNWEIGHTED,
+    //! like HOT_COLD, but the input and output symbols are 16-bit wide
+    NARROW_SYMBOLS
+};
+
+template<class Index, class Float>
+struct TransitionRecord
+{
+    Index from;
+    Index to;
+    Index input;
+    Index output;
+    Float weight;
+    bool operator<(const TransitionRecord& other)const
+    {
+        // max value in 'to' means 'go to final state'
+        if (to == std::numeric_limits<Index>::max() || other.to == std::numeric_limits<Index>::max())
+        {
+            return to > other.to;
+        }
+        // empty_symbol is always the first
+        if (input == 0 || other.input == 0)
+        {
+            return input < other.input;
+        }
+        return input > other.input;
+    }
+};
+
+//! the transitions of a Transducer, sorted and grouped by starting state
+/*!
+    Assign takes the records from Transducer::Read, after that the transitions are accessed by their ordinal.
+    The input symbols are always available in a column of Symbol (GetInputs), that is what the search of the normal transitions scans.
+*/
+template<class Index, class Float, Layout layout>
+class TransitionStorage;
+
+//! the records as they are, plus a copy of the input symbols, both are stored in the binary format
+template<class Index, class Float>
+class TransitionStorage<Index, Float, ARRAY_OF_STRUCTS>
+{
+public:
+    typedef TransitionRecord<Index, Float> Transition;
+    typedef Index Symbol;
+
+    void Assign(std::vector<Transition>& records)
+    {
+        transitions.swap(records);
+        CompileInputs();
+    }
+    size_t size()const { return transitions.size(); }
+    Index GetTo(size_t i)const { return transitions[i].to; }
+    Index GetInput(size_t i)const { return transitions[i].input; }
+    Index GetOutput(size_t i)const { return transitions[i].output; }
+    Float GetWeight(size_t i)const { return transitions[i].weight; }
+    const Index* GetInputs()const { return inputs.data(); }
+
+    template<class Output>
+    bool WriteBinary(Output& out)const
+    {
+        return out.WriteVector(transitions) && out.WriteVector(inputs);
+    }
+    template<class Input>
+    bool ReadBinary(Input& in)
+    {
+        return in.ReadVector(transitions) && in.ReadVector(inputs) && inputs.size() == transitions.size();
+    }
+    size_t GetAllocatedMemory()const
+    {
+        return sizeof(Transition) * transitions.size() + sizeof(Index) * inputs.size();
+    }
+private:
+    void CompileInputs()
+    {
+        inputs.resize(transitions.size());
+        for (size_t i = 0; i < transitions.size(); ++i)
+            inputs[i] = transitions[i].input;
+    }
+    MappedVector<Transition> transitions;
+    //! for the SIMD scan
+    MappedVector<Index> inputs;
+};
+
+//! input and to in two columns, output and weight in a third one
+/*!
+    The search of a state reads only the inputs, the rest of the transition is read if it matches.
+    The starting states are not stored, the transitions of a state are found by the headers of the Transducer.
+*/
+template<class Index, class Float>
+class TransitionStorage<Index, Float, HOT_COLD>
+{
+public:
+    typedef TransitionRecord<Index, Float> Transition;
+    typedef Index Symbol;
+
+    void Assign(std::vector<Transition>& records)
+    {
+        inputs.resize(records.size());
+        targets.resize(records.size());
+        cold.resize(records.size());
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            inputs[i] = records[i].input;
+            targets[i] = records[i].to;
+            cold[i].output = records[i].output;
+            cold[i].weight = records[i].weight;
+        }
+        records.clear();
+        records.shrink_to_fit();
+    }
+    size_t size()const { return inputs.size(); }
+    Index GetTo(size_t i)const { return targets[i]; }
+    Index GetInput(size_t i)const { return inputs[i]; }
+    Index GetOutput(size_t i)const { return cold[i].output; }
+    Float GetWeight(size_t i)const { return cold[i].weight; }
+    const Index* GetInputs()const { return inputs.data(); }
+
+    template<class Output>
+    bool WriteBinary(Output& out)const
+    {
+        return out.WriteVector(inputs) && out.WriteVector(targets) && out.WriteVector(cold);
+    }
+    template<class Input>
+    bool ReadBinary(Input& in)
+    {
+        return in.ReadVector(inputs) && in.ReadVector(targets) && in.ReadVector(cold) &&
+            targets.size() == inputs.size() && cold.size() == inputs.size();
+    }
+    size_t GetAllocatedMemory()const
+    {
+        return sizeof(Index) * (inputs.size() + targets.size()) + sizeof(Cold) * cold.size();
+    }
+private:
+    struct Cold
+    {
+        Index output;
+        Float weight;
+    };
+    MappedVector<Index> inputs;
+    MappedVector<Index> targets;
+    MappedVector<Cold> cold;
+};
+
+//! input, to and output in three columns, the weights are not stored
+/*!
+    Assign throws if any of the weights is not zero, strip the weights of the transducer first.
+*/
+template<class Index, class Float>
+class TransitionStorage<Index, Float, UNWEIGHTED>
+{
+public:
+    typedef TransitionRecord<Index, Float> Transition;
+    typedef Index Symbol;
+
+    void Assign(std::vector<Transition>& records)
+    {
+        inputs.resize(records.size());
+        targets.resize(records.size());
+        outputs.resize(records.size());
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            if (records[i].weight != 0)
+                throw Error("Transition ", i + 1, " has weight ", records[i].weight, ", but the transducer is unweighted!");
+            inputs[i] = records[i].input;
+            targets[i] = records[i].to;
+            outputs[i] = records[i].output;
+        }
+        records.clear();
+        records.shrink_to_fit();
+    }
+    size_t size()const { return inputs.size(); }
+    Index GetTo(size_t i)const { return targets[i]; }
+    Index GetInput(size_t i)const { return inputs[i]; }
+    Index GetOutput(size_t i)const { return outputs[i]; }
+    Float GetWeight(size_t)const { return 0; }
+    const Index* GetInputs()const { return inputs.data(); }
+
+    template<class Output>
+    bool WriteBinary(Output& out)const
+    {
+        return out.WriteVector(inputs) && out.WriteVector(targets) && out.WriteVector(outputs);
+    }
+    template<class Input>
+    bool ReadBinary(Input& in)
+    {
+        return in.ReadVector(inputs) && in.ReadVector(targets) && in.ReadVector(outputs) &&
+            targets.size() == inputs.size() && outputs.size() == inputs.size();
+    }
+    size_t GetAllocatedMemory()const
+    {
+        return sizeof(Index) * (inputs.size() + targets.size() + outputs.size());
+    }
+private:
+    MappedVector<Index> inputs;
+    MappedVector<Index> targets;
+    MappedVector<Index> outputs;
+};
+
+//! input, to, output and weight in four columns, the symbols are 16-bit wide
+/*!
+    Assign throws if there are more than 65536 symbols, including the flag diacritics.
+*/
+template<class Index, class Float>
+class TransitionStorage<Index, Float, NARROW_SYMBOLS>
+{
+public:
+    typedef TransitionRecord<Index, Float> Transition;
+    typedef std::uint16_t Symbol;
+
+    void Assign(std::vector<Transition>& records)
+    {
+        inputs.resize(records.size());
+        targets.resize(records.size());
+        outputs.resize(records.size());
+        weights.resize(records.size());
+        for (size_t i = 0; i < records.size(); ++i)
+        {
+            if (records[i].input > std::numeric_limits<Symbol>::max() || records[i].output > std::numeric_limits<Symbol>::max())
+                throw Error("Transition ", i + 1, " has a symbol above ", std::numeric_limits<Symbol>::max(), ", it does not fit into 16 bits!");
+            inputs[i] = Symbol(records[i].input);
+            targets[i] = records[i].to;
+            outputs[i] = Symbol(records[i].output);
+            weights[i] = records[i].weight;
+        }
+        records.clear();
+        records.shrink_to_fit();
+    }
+    size_t size()const { return inputs.size(); }
+    Index GetTo(size_t i)const { return targets[i]; }
+    Index GetInput(size_t i)const { return inputs[i]; }
+    Index GetOutput(size_t i)const { return outputs[i]; }
+    Float GetWeight(size_t i)const { return weights[i]; }
+    const Symbol* GetInputs()const { return inputs.data(); }
+
+    template<class Output>
+    bool WriteBinary(Output& out)const
+    {
+        return out.WriteVector(inputs) && out.WriteVector(targets) &&
+            out.WriteVector(outputs) && out.WriteVector(weights);
+    }
+    template<class Input>
+    bool ReadBinary(Input& in)
+    {
+        return in.ReadVector(inputs) && in.ReadVector(targets) &&
+            in.ReadVector(outputs) && in.ReadVector(weights) &&
+            targets.size() == inputs.size() && outputs.size() == inputs.size() && weights.size() == inputs.size();
+    }
+    size_t GetAllocatedMemory()const
+    {
+        return (2 * sizeof(Symbol) + sizeof(Index) + sizeof(Float)) * inputs.size();
+    }
+private:
+    MappedVector<Symbol> inputs;
+    MappedVector<Index> targets;
+    MappedVector<Symbol> outputs;
+    MappedVector<Float> weights;
+};
+
+}
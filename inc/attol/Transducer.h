@@ -6,42 +6,51 @@
 #include <functional>
 #include <array>
 #include <tuple>
+#include <utility>
 #include <cstdint>
 #include <type_traits>
 #include <unordered_set>
+#include <map>
 #include <algorithm>
+#include <chrono>
+#include <memory>
 
 #include "attol/FlagDiacritics.h"
 #include "attol/Char.h"
 #include "attol/Utils.h"
 #include "attol/Record.h"
+#include "attol/Simd.h"
+#include "attol/Storage.h"
+#include "attol/Binary.h"
+#include "attol/Parallel.h"
 
 namespace attol {
     
+//! parses a line of an AT&T file in place, the symbols are left in the line as [first, second)
 template<class CharType, class Index, class Float>
-bool AttParse(const std::basic_string<CharType>& line, 
+bool AttParse(const CharType* line, const CharType* line_end,
     Index& from, Index& to, Float& weight,
-    std::basic_string<CharType>& input, std::basic_string<CharType>& output, 
+    std::pair<const CharType*, const CharType*>& input, std::pair<const CharType*, const CharType*>& output,
     CharType field_separator = '\t')
 {
-    typedef std::basic_string<CharType> string;
-    size_t pos = 0, pos_next;
+    const CharType* pos = line;
+    const CharType* pos_next;
     int i = 0;
-    while (string::npos != (pos_next = line.find(field_separator, pos)))
+    while (line_end != (pos_next = std::find(pos, line_end, field_separator)))
     {
         switch (i++)
         {
         case 0:
-            ReadIndex(line.substr(pos, pos_next - pos).c_str(), from);
+            ParseIndex(pos, pos_next, from);
             break;
         case 1:
-            ReadIndex(line.substr(pos, pos_next - pos).c_str(), to);
+            ParseIndex(pos, pos_next, to);
             break;
         case 2:
-            input.assign(line.data() + pos, line.data() + pos_next);
+            input = std::make_pair(pos, pos_next);
             break;
         case 3:
-            output.assign(line.data() + pos, line.data() + pos_next);
+            output = std::make_pair(pos, pos_next);
             break;
         default:
             return false;
@@ -52,24 +61,22 @@ bool AttParse(const std::basic_string<CharType>& line,
     switch (i)
     {
     case 0:
-        ReadIndex(line.data() + pos, from);
+        ParseIndex(pos, line_end, from);
         to = std::numeric_limits<Index>::max();
         weight = 0;
-        input.clear();
-        output.clear();
+        input = output = std::make_pair(line_end, line_end);
         break;
     case 1:
         to = std::numeric_limits<Index>::max();
-        ReadFloat(line.data() + pos, weight);
-        input.clear();
-        output.clear();
+        ParseFloat(pos, line_end, weight);
+        input = output = std::make_pair(line_end, line_end);
         break;
     case 3:
-        output.assign(line.data() + pos);
+        output = std::make_pair(pos, line_end);
         weight = 0;
         break;
     case 4:
-        ReadFloat(line.data() + pos, weight);
+        ParseFloat(pos, line_end, weight);
         break;
     default:
         return false;
@@ -78,7 +85,21 @@ bool AttParse(const std::basic_string<CharType>& line,
     return true;
 }
 
-template<Encoding enc = UTF8, size_t storageSize = 32>
+template<class CharType, class Index, class Float>
+bool AttParse(const std::basic_string<CharType>& line, 
+    Index& from, Index& to, Float& weight,
+    std::basic_string<CharType>& input, std::basic_string<CharType>& output, 
+    CharType field_separator = '\t')
+{
+    std::pair<const CharType*, const CharType*> input_view, output_view;
+    if (!AttParse(line.data(), line.data() + line.size(), from, to, weight, input_view, output_view, field_separator))
+        return false;
+    input.assign(input_view.first, input_view.second);
+    output.assign(output_view.first, output_view.second);
+    return true;
+}
+
+template<Encoding enc = UTF8, size_t storageSize = 32, Layout layout = ARRAY_OF_STRUCTS>
 class Transducer
 {
 public:
@@ -89,28 +110,45 @@ public:
     static_assert(sizeof(Float) == sizeof(Index), "");
     static_assert(sizeof(Index) % sizeof(CharType) == 0, "");
 private:
-    struct Transition
+    typedef TransitionRecord<Index, Float> Transition;
+    typedef typename TransitionStorage<Index, Float, layout>::Symbol Symbol;
+    //! where the different kinds of transitions of a state are
+    /*!
+        The transitions of a state are sorted into consecutive sections:
+        [finals, epsilons) final transitions,
+        [epsilons, flags) epsilon transitions,
+        [flags, normals) flag diacritics,
+        [normals, specials) normal transitions in descending order of input symbol,
+        [specials, end) identity and unknown transitions.
+
+        High fanout states get a dense table indexed by the input symbol to find the normal transitions,
+        the medium fanout ones are scanned with SIMD and the others are bisected.
+    */
+    struct StateHeader
     {
-        Index from;
-        Index to;
-        Index input;
-        Index output;
-        Float weight;
-        bool operator<(const Transition& other)const
-        {
-            // max value in 'to' means 'go to final state'
-            if (to == std::numeric_limits<Index>::max() || other.to == std::numeric_limits<Index>::max())
-            {
-                return to > other.to;
-            }
-            // empty_symbol is always the first
-            if (input == 0 || other.input == 0)
-            {
-                return input < other.input;
-            }
-            return input > other.input;
-        }
+        Index finals;
+        Index epsilons;
+        Index flags;
+        Index normals;
+        Index specials;
+        Index end;
+        //! offset in dispatch_table, max value means bisection
+        Index table;
+        Index min_symbol;
+        Index max_symbol;
     };
+    //! states with fewer normal transitions than this are bisected
+    static const size_t dense_dispatch_min = 16;
+    //! a dense table can be at most this many times larger than the number of normal transitions
+    static const size_t dense_dispatch_ratio = 8;
+    //! the states without a dense table and with at least this many normal transitions are scanned with SIMD
+    static const size_t simd_scan_min = 8;
+    //! and at most this many, the others are bisected
+    static const size_t simd_scan_max = 64;
+    //! characters below this code point are segmented with a table, the others with bisection
+    static const std::uint32_t char_table_max = 0x10000;
+    //! increase this whenever the binary format changes
+    static const Index binary_version = 8;
 public:
     typedef FlagDiacritics<CharType, typename std::make_signed<Index>::type> FlagDiacriticsType;
     typedef typename FlagDiacriticsType::State FlagState;
@@ -133,7 +171,7 @@ public:
         */
         const CharType* InterpretOutput()const
         {
-            static CharType buffer[5]; // should be plenty for all encodings
+            static thread_local CharType buffer[5]; // should be plenty for all encodings
             const auto output = GetOutput();
             if (FlagDiacriticsType::IsIt(output))
                 return output + std::char_traits<CharType>::length(output);
@@ -148,94 +186,945 @@ public:
         }
     };
     typedef std::vector<PathValue> Path;
+    //! everything that changes during a lookup
+    /*!
+        The transducer itself is not modified by Lookup,
+        so one transducer can be shared among threads if each thread has its own context.
+    */
+    class LookupContext
+    {
+    public:
+        LookupContext()
+            : max_results(0), max_depth(0), time_limit(0), resulthandler([](const Path&) {}),
+            dead_end_memo(false), profile(false),
+            n_results(0), n_found(0), n_cutoffs(0), input_tape_pos(0), flag_failed(false), timed_out(false), steps(0),
+            dead_end_hits(0), dead_end_entries(0), word(0)
+        {
+        }
+        size_t max_results;
+        size_t max_depth;
+        double time_limit;
+        std::function<void(const Path& path)> resulthandler;
+        //! remember the configurations which lead to no analysis and do not search them again within a word
+        /*!
+            Only used by Lookup, a configuration is a state, a position on the input tape and a flag state.
+            Pays off if many epsilon or flag diacritic paths meet again, costs a hash lookup per step otherwise.
+        */
+        bool dead_end_memo;
+        //! count how many times each transition is followed, only in Lookup
+        bool profile;
+        //! number of times each transition was followed, indexed by the transition ID, summed over the lookups with profile
+        const std::vector<size_t>& GetTransitionHits()const { return transition_hits; }
+        //! number of times a configuration was skipped because of dead_end_memo, summed over the lookups
+        size_t GetDeadEndHits()const { return dead_end_hits; }
+        //! number of configurations memorized as dead ends, summed over the lookups
+        size_t GetDeadEnds()const { return dead_end_entries; }
+        //! whether the last lookup was stopped by time_limit, its results may be incomplete
+        bool TimedOut()const { return timed_out; }
+        //! in LookupBatch, the index of the word which the reported path belongs to
+        size_t GetWord()const { return word; }
+    private:
+        friend class Transducer;
+        Path path;
+        size_t n_results;
+        //! number of analyses found, regardless of the limits
+        size_t n_found;
+        //! number of times the search was cut short by a limit
+        size_t n_cutoffs;
+        std::vector<Index> input_tape;
+        Index input_tape_pos;
+        bool flag_failed;
+        bool timed_out;
+        //! the clock is read only once in this many steps
+        static const size_t clock_interval = 256;
+        size_t steps;
+        std::chrono::steady_clock::time_point deadline;
+        void StartClock()
+        {
+            timed_out = false;
+            steps = 0;
+            if (time_limit > 0)
+                deadline = std::chrono::steady_clock::now() +
+                    std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(time_limit));
+        }
+        bool TimeIsUp()
+        {
+            if (!timed_out && time_limit > 0 && ++steps % clock_interval == 0)
+                timed_out = std::chrono::steady_clock::now() >= deadline;
+            return timed_out;
+        }
+        //! a point of the depth-first search where the rest of the search depends only on these
+        struct Configuration
+        {
+            Index state;
+            Index input_tape_pos;
+            typename FlagDiacriticsType::StorageType flag_state;
+            bool flag_failed;
+            bool operator==(const Configuration& other)const
+            {
+                return state == other.state && input_tape_pos == other.input_tape_pos &&
+                    flag_state == other.flag_state && flag_failed == other.flag_failed;
+            }
+        };
+        struct ConfigurationHash
+        {
+            size_t operator()(const Configuration& c)const
+            {
+                size_t h = std::hash<Index>()(c.state);
+                h = h * 31 + std::hash<Index>()(c.input_tape_pos);
+                h = h * 31 + std::hash<typename FlagDiacriticsType::StorageType>()(c.flag_state);
+                return h * 2 + c.flag_failed;
+            }
+        };
+        std::unordered_set<Configuration, ConfigurationHash> dead_ends;
+        size_t dead_end_hits;
+        size_t dead_end_entries;
+        std::vector<size_t> transition_hits;
+        //! a prefix of some words in LookupBatch
+        struct TrieNode
+        {
+            //! the last symbol of the prefix
+            Index symbol;
+            Index parent;
+            Index depth;
+            //! the children are next to each other in the trie
+            Index children;
+            Index children_end;
+            //! the words which end here, in trie_words
+            Index words;
+            Index words_end;
+            //! number of words in the subtree which need more results
+            Index open;
+        };
+        std::vector<TrieNode> trie;
+        //! the indices of the words in lexicographic order of their symbols
+        std::vector<Index> trie_words;
+        //! the segmented words one after the other
+        std::vector<Index> batch_symbols;
+        std::vector<size_t> batch_offsets;
+        std::vector<size_t> word_results;
+        size_t word;
+        //! a partial path in the best-first search
+        struct SearchNode
+        {
+            //! the last step of the path, parent is the rest
+            PathValue step;
+            size_t parent;
+            Float weight;
+            Index state;
+            Index input_tape_pos;
+            Index depth;
+            bool flag_failed;
+            bool final;
+        };
+        std::vector<SearchNode> nodes;
+        //! heap of (weight, node) pairs, equal weights are expanded in the order they were found
+        std::vector<std::pair<Float, size_t>> queue;
+    };
 private:
     template<class Alphabet>
     void CompileAlphabet(Alphabet& alphabet_hash)
     {
         alphabet.resize(alphabet_hash.size());
-        reverse_alphabet_map.clear();
         raw_alphabet.clear();
         raw_alphabet.reserve(2 * alphabet_hash.size());
         for (const auto& symbol : alphabet_hash)
         {
-            reverse_alphabet_map[symbol.first] = symbol.second;
             alphabet[symbol.second] = (Index)raw_alphabet.size();
             raw_alphabet.insert(raw_alphabet.end(), symbol.first.begin(), symbol.first.end());
             raw_alphabet.emplace_back((CharType)0);
         }
+        sorted_symbols.resize(alphabet.size());
+        for (Index symbol = 0; symbol < alphabet.size(); ++symbol)
+            sorted_symbols[symbol] = symbol;
+        std::sort(sorted_symbols.begin(), sorted_symbols.end(), [this](Index a, Index b)
+        {
+            const CharType* s = GetSymbolStr(b);
+            return CompareSymbol(a, s, s + std::char_traits<CharType>::length(s)) < 0;
+        });
     }
     const CharType* GetSymbolStr(Index symbol)const
     {
         return raw_alphabet.data() + alphabet[symbol];
     }
-    std::vector<CharType> raw_alphabet;
-    std::vector<Index> alphabet;
-    std::unordered_map<string, Index> reverse_alphabet_map;
-    std::vector<Transition> transitions;
+    //! compares the string of a symbol to [begin, end) code unit by code unit
+    int CompareSymbol(Index symbol, const CharType* begin, const CharType* end)const
+    {
+        for (const CharType* s = GetSymbolStr(symbol); ; ++s, ++begin)
+        {
+            if (begin == end)
+                return *s ? 1 : 0;
+            // a prefix is the smaller, whatever the sign of the code units
+            if (!*s)
+                return -1;
+            if (*s != *begin)
+                return *s < *begin ? -1 : 1;
+        }
+    }
+    //! the symbol of the string [begin, end), max value if there is none
+    Index FindSymbol(const CharType* begin, const CharType* end)const
+    {
+        const auto it = std::lower_bound(sorted_symbols.begin(), sorted_symbols.end(), begin, [this, end](Index symbol, const CharType* b)
+        {
+            return CompareSymbol(symbol, b, end) < 0;
+        });
+        return it != sorted_symbols.end() && CompareSymbol(*it, begin, end) == 0 ? *it : std::numeric_limits<Index>::max();
+    }
+    //! builds the tables for Segment, the alphabet has to be compiled already
+    /*!
+        Only the symbols of one character are here, the multi-character ones are in the tokenizer.
+    */
+    void CompileCharacters()
+    {
+        char_table.clear();
+        rare_chars.clear();
+        for (Index symbol = 0; symbol < alphabet.size(); ++symbol)
+        {
+            const CharType* begin = GetSymbolStr(symbol);
+            const CharType* end = begin + std::char_traits<CharType>::length(begin);
+            std::uint32_t code_point;
+            if (begin == end || GetNextCharacter<enc>(begin) != end || !DecodeCharacter<enc>(begin, end, code_point))
+                continue;
+            if (code_point < char_table_max)
+            {
+                if (code_point >= char_table.size())
+                    char_table.resize(code_point + 1, unknown_symbol);
+                char_table[code_point] = symbol;
+            }
+            else
+                rare_chars.push_back(CharSymbol{ code_point, symbol });
+        }
+        std::sort(rare_chars.begin(), rare_chars.end(), [](const CharSymbol& a, const CharSymbol& b)
+        {
+            return a.code_point < b.code_point;
+        });
+    }
+    //! builds the trie of the multi-character input symbols, transitions have to be read already
+    /*!
+        Only the symbols which are read by normal transitions are tokenized,
+        the flag diacritics, the special symbols and the output-only symbols are not.
+    */
+    void CompileTokenizer()
+    {
+        token_nodes.clear();
+        token_edges.clear();
+        std::vector<bool> is_input(alphabet.size(), false);
+        for (size_t i = 0; i < transitions.size(); ++i)
+            if (transitions.GetTo(i) != std::numeric_limits<Index>::max() && transitions.GetInput(i) < flag_symbol)
+                is_input[transitions.GetInput(i)] = true;
+        is_input[empty_symbol] = is_input[unknown_symbol] = is_input[identity_symbol] = false;
+        // the trie with the children in maps first
+        std::vector<std::pair<Index, std::map<Index, Index>>> trie(1, std::make_pair(std::numeric_limits<Index>::max(), std::map<Index, Index>()));
+        for (Index symbol = 0; symbol < alphabet.size(); ++symbol)
+        {
+            const CharType* s = GetSymbolStr(symbol);
+            if (!is_input[symbol] || GetNextCharacter<enc>(s) == s + std::char_traits<CharType>::length(s))
+                continue;
+            Index node = 0;
+            for (; *s; ++s)
+            {
+                const auto it = trie[node].second.emplace(Index(typename std::make_unsigned<CharType>::type(*s)), Index(trie.size()));
+                if (it.second)
+                    trie.emplace_back(std::numeric_limits<Index>::max(), std::map<Index, Index>());
+                node = it.first->second;
+            }
+            trie[node].first = symbol;
+        }
+        if (trie.size() == 1)
+            // nothing to tokenize, Segment goes character by character
+            return;
+        for (const auto& node : trie)
+        {
+            token_nodes.push_back(TokenNode{ node.first, Index(token_edges.size()), Index(token_edges.size() + node.second.size()) });
+            for (const auto& child : node.second)
+                token_edges.push_back(TokenEdge{ child.first, child.second });
+        }
+    }
+    //! follows a code unit in the trie of the multi-character symbols, max value if there is nothing to follow
+    Index TokenChild(Index node, CharType c)const
+    {
+        const Index unit = typename std::make_unsigned<CharType>::type(c);
+        const auto begin = token_edges.begin() + token_nodes[node].edges;
+        const auto end = token_edges.begin() + token_nodes[node].edges_end;
+        const auto it = std::lower_bound(begin, end, unit, [](const TokenEdge& e, Index u) { return e.unit < u; });
+        return it != end && it->unit == unit ? it->target : std::numeric_limits<Index>::max();
+    }
+    template<class Output>
+    bool write_binary(Output& out)const
+    {
+        // BOM
+        static const BOM<enc> bom;
+        if (sizeof(bom) > 1 && !out.Write(bom.bytes.data(), sizeof(bom)))
+            return false;
+        // storage size info
+        {
+            const Index width = storageSize;
+            if (!out.Write(width))
+                return false;
+            const Index version = binary_version;
+            if (!out.Write(version))
+                return false;
+            const Index storage_layout = layout;
+            if (!out.Write(storage_layout))
+                return false;
+        }
+        // alphabet
+        {
+            if (!out.WriteVector(raw_alphabet))
+                return false;
+            if (!out.WriteVector(alphabet))
+                return false;
+            if (!out.WriteVector(sorted_symbols))
+                return false;
+            if (!out.WriteVector(char_table))
+                return false;
+            if (!out.WriteVector(rare_chars))
+                return false;
+            if (!out.WriteVector(token_nodes))
+                return false;
+            if (!out.WriteVector(token_edges))
+                return false;
+        }
+        if (!fd_table.Write(out))
+            return false;
+
+        if (!out.Write(unknown_symbol))
+            return false;
+        if (!out.Write(identity_symbol))
+            return false;
+        if (!out.Write(empty_symbol))
+            return false;
+        if (!out.Write(flag_symbol))
+            return false;
+
+        // transitions themselves
+        if (!transitions.WriteBinary(out))
+            return false;
+        if (!out.WriteVector(headers))
+            return false;
+        if (!out.WriteVector(dispatch_table))
+            return false;
+        return out.WriteVector(heuristic);
+    }
+    template<class Input>
+    bool read_binary(Input& in)
+    {
+        n_states = 0;
+        // BOM
+        {
+            static const BOM<enc> bom_standard;
+            BOM<enc> bom_actual;
+            if (sizeof(bom_actual) > 1 && (!in.Read((void*)bom_actual.bytes.data(), sizeof(bom_actual)) || bom_actual.bytes != bom_standard.bytes))
+                return false;
+        }
+        // storage size info
+        {
+            Index width;
+            if (!in.Read(width))
+                return false;
+            if (width != storageSize)
+                return false;
+            Index version;
+            if (!in.Read(version))
+                return false;
+            if (version != binary_version)
+                return false;
+            Index storage_layout;
+            if (!in.Read(storage_layout))
+                return false;
+            if (storage_layout != layout)
+                return false;
+        }
+        // alphabet
+        {
+            if (!in.ReadVector(raw_alphabet))
+                return false;
+            if (!in.ReadVector(alphabet))
+                return false;
+            if (!in.ReadVector(sorted_symbols))
+                return false;
+            if (!in.ReadVector(char_table))
+                return false;
+            if (!in.ReadVector(rare_chars))
+                return false;
+            if (!in.ReadVector(token_nodes))
+                return false;
+            if (!in.ReadVector(token_edges))
+                return false;
+        }
+        if (!fd_table.Read(in))
+            return false;
+
+        if (!in.Read(unknown_symbol))
+            return false;
+        if (!in.Read(identity_symbol))
+            return false;
+        if (!in.Read(empty_symbol))
+            return false;
+        if (!in.Read(flag_symbol))
+            return false;
+
+        if (!transitions.ReadBinary(in))
+            return false;
+        if (!in.ReadVector(headers))
+            return false;
+        if (!in.ReadVector(dispatch_table))
+            return false;
+        if (!in.ReadVector(heuristic))
+            return false;
+        // there is an extra one for the dangling edges
+        n_states = headers.empty() ? 0 : headers.size() - 1;
+        return true;
+    }
+    //! builds the per-state search structures from the records sorted by Read, before they are stored
+    void CompileHeaders(const std::vector<Transition>& records)
+    {
+        const Index n = SaturateCast<Index>::Do(records.size());
+        // the one after the last is where the dangling edges lead
+        headers.assign(n_states + 1, StateHeader{ n, n, n, n, n, n, std::numeric_limits<Index>::max(), 0, 0 });
+        dispatch_table.clear();
+        Index i, j;
+        for (i = 0; i < n; i = j)
+        {
+            const auto state = records[i].from;
+            for (j = i; j < n && records[j].from == state; ++j);
+
+            StateHeader& h = headers[state];
+            h.finals = i;
+            for (h.epsilons = h.finals; h.epsilons < j && records[h.epsilons].to == std::numeric_limits<Index>::max(); ++h.epsilons);
+            for (h.flags = h.epsilons; h.flags < j && records[h.flags].input == empty_symbol; ++h.flags);
+            for (h.normals = h.flags; h.normals < j && records[h.normals].input >= flag_symbol; ++h.normals);
+            for (h.specials = h.normals; h.specials < j &&
+                records[h.specials].input != unknown_symbol &&
+                records[h.specials].input != identity_symbol; ++h.specials);
+            h.end = j;
+
+            h.min_symbol = h.normals < h.specials ? records[h.specials - 1].input : 0;
+            h.max_symbol = h.normals < h.specials ? records[h.normals].input : 0;
+            const size_t fanout = h.specials - h.normals;
+            const size_t span = size_t(h.max_symbol - h.min_symbol) + 1;
+            if (fanout >= dense_dispatch_min && span <= dense_dispatch_ratio * fanout)
+            {
+                // entry k is the first transition with input <= min_symbol + k - 1
+                h.table = SaturateCast<Index>::Do(dispatch_table.size());
+                dispatch_table.resize(dispatch_table.size() + span + 1);
+                auto table = dispatch_table.begin() + h.table;
+                Index k = h.specials;
+                for (size_t symbol = 0; symbol <= span; ++symbol)
+                {
+                    while (k > h.normals && records[k - 1].input < h.min_symbol + symbol)
+                        --k;
+                    table[symbol] = k;
+                }
+            }
+        }
+    }
+    //! calculates the minimum weight from every state to a final transition
+    /*!
+        The input and the flag diacritics are ignored, so this is a lower bound of the remaining weight of
+        any path in the best-first search, an admissible and consistent heuristic.
+        States with infinite heuristic cannot lead to any analysis.
+
+        If the relaxations do not settle (because of negative cycles, for example)
+        then the heuristic is left empty and the best-first search goes on without it.
+    */
+    void CompileHeuristic()
+    {
+        typedef std::pair<Float, Index> QueueItem;
+        const Float infinity = std::numeric_limits<Float>::infinity();
+        // incoming transitions of the states, in compressed rows
+        std::vector<size_t> first(n_states + 2, 0);
+        std::vector<std::pair<Index, Index>> incoming;
+        for (Index state = 0; state < n_states; ++state)
+            for (Index i = headers[state].epsilons; i < headers[state].end; ++i)
+                ++first[transitions.GetTo(i) + 1];
+        for (size_t state = 0; state <= n_states; ++state)
+            first[state + 1] += first[state];
+        incoming.resize(first.back());
+        {
+            auto next = first;
+            for (Index state = 0; state < n_states; ++state)
+                for (Index i = headers[state].epsilons; i < headers[state].end; ++i)
+                    incoming[next[transitions.GetTo(i)]++] = std::make_pair(state, i);
+        }
+
+        heuristic.assign(n_states + 1, infinity);
+        std::vector<QueueItem> queue;
+        for (Index state = 0; state < n_states; ++state)
+        {
+            for (Index i = headers[state].finals; i < headers[state].epsilons; ++i)
+                heuristic[state] = std::min(heuristic[state], transitions.GetWeight(i));
+            if (heuristic[state] < infinity)
+                queue.emplace_back(heuristic[state], state);
+        }
+        std::make_heap(queue.begin(), queue.end(), std::greater<QueueItem>());
+        // Dijkstra, but a state can be relaxed again if the weights are negative
+        size_t relaxations = 0;
+        const size_t max_relaxations = 16 * (transitions.size() + n_states);
+        while (!queue.empty())
+        {
+            std::pop_heap(queue.begin(), queue.end(), std::greater<QueueItem>());
+            const auto item = queue.back();
+            queue.pop_back();
+            if (item.first > heuristic[item.second])
+                continue;
+            for (size_t e = first[item.second]; e < first[item.second + 1]; ++e)
+            {
+                const auto from = incoming[e].first;
+                const Float weight = transitions.GetWeight(incoming[e].second) + item.first;
+                if (weight < heuristic[from])
+                {
+                    if (++relaxations > max_relaxations)
+                    {
+                        heuristic.clear();
+                        return;
+                    }
+                    heuristic[from] = weight;
+                    queue.emplace_back(weight, from);
+                    std::push_heap(queue.begin(), queue.end(), std::greater<QueueItem>());
+                }
+            }
+        }
+    }
+    //! finds the normal transitions of a state which read a given input symbol
+    void FindNormal(const StateHeader& h, Index symbol, Index& begin, Index& end)const
+    {
+        if (h.table != std::numeric_limits<Index>::max())
+        {
+            if (symbol < h.min_symbol || symbol > h.max_symbol)
+            {
+                begin = end = h.specials;
+            }
+            else
+            {
+                const auto table = dispatch_table.data() + h.table + (symbol - h.min_symbol);
+                begin = table[1];
+                end = table[0];
+            }
+        }
+        else if (h.specials - h.normals >= simd_scan_min && h.specials - h.normals <= simd_scan_max)
+        {
+            // the inputs are in descending order, so the matching ones come after the greater ones
+            size_t greater, equal;
+            CountGreaterEqual(transitions.GetInputs() + h.normals, h.specials - h.normals, Symbol(symbol), greater, equal);
+            begin = h.normals + Index(greater);
+            end = begin + Index(equal);
+        }
+        else
+        {
+            // branchless bisection for the first transition with input <= symbol
+            const Symbol* const inputs = transitions.GetInputs();
+            const Symbol* base = inputs + h.normals;
+            size_t n = h.specials - h.normals;
+            if (n == 0)
+            {
+                begin = end = h.specials;
+                return;
+            }
+            while (n > 1)
+            {
+                const size_t half = n / 2;
+                base = (base[half] > symbol) ? base + half : base;
+                n -= half;
+            }
+            begin = Index((base - inputs) + (*base > symbol));
+            for (end = begin; end < h.specials && inputs[end] == symbol; ++end);
+        }
+    }
+    struct CharSymbol
+    {
+        std::uint32_t code_point;
+        Index symbol;
+    };
+    MappedVector<CharType> raw_alphabet;
+    MappedVector<Index> alphabet;
+    //! the symbols in the order of their strings, for FindSymbol
+    MappedVector<Index> sorted_symbols;
+    //! symbol of each code point, see CompileCharacters
+    MappedVector<Index> char_table;
+    //! the symbols with a code point above char_table_max, in increasing order
+    MappedVector<CharSymbol> rare_chars;
+    struct TokenNode
+    {
+        //! the symbol which ends here, max value if none
+        Index symbol;
+        Index edges;
+        Index edges_end;
+    };
+    struct TokenEdge
+    {
+        Index unit;
+        Index target;
+    };
+    //! trie of the multi-character input symbols in code units, empty if there are none, see CompileTokenizer
+    MappedVector<TokenNode> token_nodes;
+    //! the edges of a node are next to each other, in increasing order of the code unit
+    MappedVector<TokenEdge> token_edges;
+    TransitionStorage<Index, Float, layout> transitions;
+    MappedVector<StateHeader> headers;
+    MappedVector<Index> dispatch_table;
+    //! lower bound of the weight from a state to the end of any path, see CompileHeuristic
+    MappedVector<Float> heuristic;
     size_t n_states;
     FlagDiacriticsType fd_table;
     Index unknown_symbol, identity_symbol, empty_symbol, flag_symbol;
-    // during the lookup
-    // TODO make the above const during the lookup
-    // static inheritance
-    Path path;
-    size_t n_results;
-    std::vector<Index> input_tape;
-    Index input_tape_pos;
-    Clock<> myclock;
-    bool flag_failed;
+    //! the memory which the vectors point into after MapBinary, null if they are in the heap
+    std::shared_ptr<const MappedFile> image;
+    template<Encoding, size_t, Layout>
+    friend class Transducer;
+    //! a piece of an AT&T file which starts with a new state, parsed on its own by ParseChunk
+    /*!
+        The records are numbered in the chunk: 'from' is the state of the chunk, the symbols and the flag diacritics
+        are the IDs of symbols and flags. The starts are (state in the file, state of the chunk, record of the chunk)
+        wherever a state begins.
+    */
+    struct TextChunk
+    {
+        const CharType* begin;
+        const CharType* end;
+        std::vector<Transition> records;
+        Counter<string, Index> symbols, flags;
+        std::vector<std::tuple<Index, Index, size_t>> starts;
+        //! parsing stopped at an empty line or, if invalid, at a line which is not AT&T
+        bool stop, invalid;
+    };
+    //! [line, line_end) is the next line without the end-of-line, returns where the line after it begins
+    static const CharType* NextLine(const CharType* line, const CharType* end, const CharType*& line_end)
+    {
+        const CharType* newline = std::find(line, end, CharType('\n'));
+        line_end = newline;
+        if (line_end != line && line_end[-1] == CharType('\r'))
+            --line_end;
+        return newline == end ? end : newline + 1;
+    }
+    static bool IsNumber(const CharType* begin, const CharType* end, bool sign)
+    {
+        if (sign && begin != end && (*begin == CharType('-') || *begin == CharType('+')))
+            ++begin;
+        return begin != end && *begin >= CharType('0') && *begin <= CharType('9');
+    }
+    //! whether a chunk can begin with the line: it starts a new state and AttParse takes nothing from the line before
+    static bool IsChunkStart(const CharType* previous, const CharType* previous_end,
+        const CharType* line, const CharType* line_end, CharType field_separator)
+    {
+        const CharType* begins[5];
+        const CharType* ends[5];
+        size_t n = 0;
+        for (const CharType* s = line; ; s = ends[n - 1] + 1)
+        {
+            if (n == 5)
+                return false;
+            begins[n] = s;
+            ends[n] = std::find(s, line_end, field_separator);
+            if (ends[n++] == line_end)
+                break;
+        }
+        const CharType* previous_from_end = std::find(previous, previous_end, field_separator);
+        if (n == 3 || !IsNumber(begins[0], ends[0], false) || !IsNumber(previous, previous_from_end, false) ||
+            (n >= 4 && !IsNumber(begins[1], ends[1], false)) ||
+            ((n == 2 || n == 5) && !IsNumber(begins[n - 1], ends[n - 1], true)))
+            return false;
+        Index from, previous_from;
+        ParseIndex(begins[0], ends[0], from);
+        ParseIndex(previous, previous_from_end, previous_from);
+        return from != previous_from;
+    }
+    //! the same as the loop of Read, but the first chunk of the file is the only one which starts in state 0
+    static void ParseChunk(TextChunk& chunk, bool first, CharType field_separator)
+    {
+        Index previous_state = 0, state = 0;
+        Index from = 0, to = std::numeric_limits<Index>::max();
+        Float weight = 0;
+        std::pair<const CharType*, const CharType*> input_view, output_view;
+        string input, output;
+        chunk.stop = chunk.invalid = false;
+        for (const CharType* line = chunk.begin, *line_end, *next; line != chunk.end; line = next)
+        {
+            next = NextLine(line, chunk.end, line_end);
+            if (line == line_end)
+            {
+                chunk.stop = true;
+                return;
+            }
+            if (!AttParse<CharType>(line, line_end, from, to, weight, input_view, output_view, field_separator))
+            {
+                chunk.stop = chunk.invalid = true;
+                return;
+            }
+            if (previous_state != from || (!first && chunk.records.empty()))
+            {
+                if (!chunk.records.empty())
+                    ++state;
+                chunk.starts.emplace_back(from, state, chunk.records.size());
+                previous_state = from;
+            }
+            chunk.records.emplace_back();
+            auto& record = chunk.records.back();
+            if (to != std::numeric_limits<Index>::max())
+            {
+                input.assign(input_view.first, input_view.second);
+                output.assign(output_view.first, output_view.second);
+                for (auto s : { &input, &output })
+                {
+                    if (StrEqual(s->c_str(), "@0@") || StrEqual(s->c_str(), "@_EPSILON_SYMBOL_@"))
+                        s->clear();
+                }
+                if (FlagDiacriticsType::IsIt(input.c_str()))
+                {
+                    record.input = std::numeric_limits<Index>::max();
+                    record.output = chunk.flags[output];
+                }
+                else
+                {
+                    record.input = chunk.symbols[input];
+                    record.output = chunk.symbols[output];
+                }
+            }
+            record.from = state;
+            record.to = to;
+            record.weight = weight;
+        }
+    }
+    //! adds the symbols of a chunk to the hash table in the order of their IDs, map is from the old IDs to the new ones
+    static void MergeSymbols(Counter<string, Index>& symbols, Counter<string, Index>& hash, std::vector<Index>& map)
+    {
+        std::vector<const string*> strings(symbols.size());
+        for (const auto& symbol : symbols)
+            strings[symbol.second] = &symbol.first;
+        map.resize(strings.size());
+        for (size_t id = 0; id < strings.size(); ++id)
+            map[id] = hash[*strings[id]];
+        symbols.clear();
+    }
+    //! the flag diacritics come after the symbols of the transitions, returns the symbol of each flag diacritic ID
+    std::vector<Index> CompileSymbols(Counter<string, Index>& alphabet_hash, const Counter<string, Index>& flag_hash)
+    {
+        flag_symbol = SaturateCast<Index>::Do(alphabet_hash.size());
+        std::vector<Index> flag_symbols(flag_hash.size());
+        for (const auto& flag : flag_hash)
+        {
+            flag_symbols[flag.second] = alphabet_hash[flag.first];
+            fd_table.Memorize(flag.first.c_str(), flag_symbols[flag.second]);
+        }
+        CompileAlphabet(alphabet_hash);
+        CompileCharacters();
+        fd_table.CalculateOffsets();
+        return flag_symbols;
+    }
+    //! Read on n_threads threads, the file is split at state boundaries and the chunks are parsed in parallel
+    /*!
+        The symbols of the chunks are merged in the order of their first appearance in the file,
+        so that the hash tables, hence the alphabet and the flag diacritics, are the same as after Read.
+        The errors are the ones Read would throw first.
+    */
+    void ReadParallel(FILE* f, CharType field_separator, size_t n_threads)
+    {
+        alphabet.clear();
+        n_states = 0;
+        std::vector<CharType> text;
+        for (size_t size = 0, block = 1 << 16; ; )
+        {
+            text.resize(size + block);
+            const size_t n = fread(text.data() + size, sizeof(CharType), block, f);
+            size += n;
+            if (n < block)
+            {
+                text.resize(size);
+                break;
+            }
+        }
+        const CharType* const text_begin = text.data();
+        const CharType* const text_end = text_begin + text.size();
+
+        std::vector<TextChunk> chunks(1);
+        chunks[0].begin = text_begin;
+        for (size_t k = 1; k < n_threads; ++k)
+        {
+            const CharType* line = std::max(chunks.back().begin, text_begin + text.size() / n_threads * k);
+            line = std::find(line, text_end, CharType('\n'));
+            if (line == text_end)
+                break;
+            const CharType* previous = chunks.back().begin;
+            for (const CharType* s = line; s != previous; --s)
+                if (s[-1] == CharType('\n'))
+                {
+                    previous = s;
+                    break;
+                }
+            const CharType* previous_end = line;
+            if (previous_end != previous && previous_end[-1] == CharType('\r'))
+                --previous_end;
+            for (++line; line != text_end; )
+            {
+                const CharType* line_end;
+                const CharType* next = NextLine(line, text_end, line_end);
+                if (IsChunkStart(previous, previous_end, line, line_end, field_separator))
+                    break;
+                previous = line;
+                previous_end = line_end;
+                line = next;
+            }
+            if (line == text_end)
+                break;
+            chunks.back().end = line;
+            chunks.emplace_back();
+            chunks.back().begin = line;
+        }
+        chunks.back().end = text_end;
+
+        ParallelFor(n_threads, chunks.size(), [&](size_t c)
+        {
+            ParseChunk(chunks[c], c == 0, field_separator);
+        });
+
+        // the chunks after an empty or invalid line are not read by Read
+        for (size_t c = 0; c < chunks.size(); ++c)
+            if (chunks[c].stop)
+            {
+                chunks.resize(c + 1);
+                break;
+            }
+        std::vector<size_t> state_offsets(chunks.size() + 1, 0), record_offsets(chunks.size() + 1, 0);
+        for (size_t c = 0; c < chunks.size(); ++c)
+        {
+            const auto& records = chunks[c].records;
+            state_offsets[c + 1] = state_offsets[c] + (records.empty() ? 0 : size_t(records.back().from) + 1);
+            record_offsets[c + 1] = record_offsets[c] + records.size();
+        }
+
+        // from the state numbers in the file to the order of appearance, in the order of the file
+        // so that the first state which is visited again is reported, the invalid line is after all of them
+        IndexMap<Index, Index> start_pointers;
+        start_pointers.Insert(0, 0);
+        for (size_t c = 0; c < chunks.size(); ++c)
+        {
+            for (const auto& start : chunks[c].starts)
+                if (!start_pointers.Insert(std::get<0>(start), Index(state_offsets[c] + std::get<1>(start))))
+                    // this state has already been visited
+                    throw Error("Transitions are not ordered by starting state! Starting state of transition ", record_offsets[c] + std::get<2>(start) + 1, " has already been visited.");
+            chunks[c].starts.clear();
+            chunks[c].starts.shrink_to_fit();
+        }
+        if (chunks.back().invalid)
+            throw Error("AT&T file at line ", record_offsets[chunks.size()] + 1, " is invalid!");
+
+        Counter<string, Index> alphabet_hash, flag_hash;
+        empty_symbol = alphabet_hash[Convert<CharType>("")];
+        unknown_symbol = alphabet_hash[Convert<CharType>("@_UNKNOWN_SYMBOL_@")];
+        identity_symbol = alphabet_hash[Convert<CharType>("@_IDENTITY_SYMBOL_@")];
+        // from the IDs of the chunks to the global ones
+        std::vector<std::vector<Index>> symbol_maps(chunks.size()), flag_maps(chunks.size());
+        for (size_t c = 0; c < chunks.size(); ++c)
+        {
+            MergeSymbols(chunks[c].symbols, alphabet_hash, symbol_maps[c]);
+            MergeSymbols(chunks[c].flags, flag_hash, flag_maps[c]);
+        }
+
+        std::vector<Transition> records(record_offsets.back());
+        n_states = records.empty() ? start_pointers.size() : state_offsets[chunks.size()];
+        const auto flag_symbols = CompileSymbols(alphabet_hash, flag_hash);
+
+        ParallelFor(n_threads, chunks.size(), [&](size_t c)
+        {
+            auto& chunk_records = chunks[c].records;
+            const auto begin = records.begin() + record_offsets[c];
+            for (size_t r = 0; r < chunk_records.size(); ++r)
+            {
+                auto& t = *(begin + r);
+                t = chunk_records[r];
+                t.from += Index(state_offsets[c]);
+                if (t.to != std::numeric_limits<Index>::max())
+                {   // non-final state
+                    if (t.input == std::numeric_limits<Index>::max())
+                    {
+                        t.input = flag_symbols[flag_maps[c][t.output]];
+                        t.output = flag_maps[c][t.output];
+                        fd_table.Compile(t.input, t.output);
+                    }
+                    else
+                    {
+                        t.input = symbol_maps[c][t.input];
+                        t.output = symbol_maps[c][t.output];
+                    }
+                    const Index* to = start_pointers.Find(t.to);
+                    // or a dangling edge
+                    t.to = to ? *to : (Index)n_states;
+                }
+            }
+            chunk_records.clear();
+            chunk_records.shrink_to_fit();
+            const auto end = records.begin() + record_offsets[c + 1];
+            for (auto i = begin, j = begin; i != end; i = j)
+            {
+                for (; j != end && j->from == i->from; ++j);
+                std::sort(i, j);
+            }
+        });
+        CompileHeaders(records);
+        transitions.Assign(records);
+        CompileHeuristic();
+        CompileTokenizer();
+    }
 public:
     Transducer()
-        : n_states(0), input_tape_pos(0), max_results(0), max_depth(0), time_limit(0), resulthandler([](const Path&) {})
+        : n_states(0)
     {
     }
     Transducer(FILE* f, CharType field_separator = '\t')
-        : n_states(0), input_tape_pos(0), max_results(0), max_depth(0), time_limit(0), resulthandler([](const Path&) {})
+        : n_states(0)
     {
         Read(f, field_separator);
     }
-    void Read(FILE* f, CharType field_separator = '\t')
+    //! reads an AT&T text file, on n_threads threads if more than one, the result is the same
+    void Read(FILE* f, CharType field_separator = '\t', size_t n_threads = 1)
     {
-        std::unordered_map<Index, Index> start_pointers;
-        start_pointers[0] = 0;
-        transitions.clear();
+        if (n_threads > 1)
+        {
+            ReadParallel(f, field_separator, n_threads);
+            return;
+        }
+        // from the state numbers in the file to the order of appearance
+        IndexMap<Index, Index> start_pointers;
+        start_pointers.Insert(0, 0);
+        std::vector<Transition> records;
         alphabet.clear();
         n_states = 0;
         Counter<string, Index> alphabet_hash, flag_hash;
         {
-            CharType c;
-            Index previous_state = 0;
-            string line;
+            LineReader<CharType> reader(f);
+            const CharType* begin;
+            size_t length;
+            Index previous_state = 0, state = 0;
             Index from = 0, to = std::numeric_limits<Index>::max();
+            std::pair<const CharType*, const CharType*> input_view, output_view;
+            // only for the hash tables
             string input, output;
-            Float weight;
+            Float weight = 0;
             empty_symbol = alphabet_hash[Convert<CharType>("")];
             unknown_symbol = alphabet_hash[Convert<CharType>("@_UNKNOWN_SYMBOL_@")];
             identity_symbol = alphabet_hash[Convert<CharType>("@_IDENTITY_SYMBOL_@")];
-            while (!feof(f))
-            {
-                line.clear();
-                while (fread(&c, sizeof(CharType), 1, f) == 1 && c != '\n')
-                    line.push_back(c);
-                if (!line.empty() && line.back() == '\r')
-                    line.pop_back();
-                if (line.empty())
+            while (reader.Next(begin, length))
+            {
+                if (length == 0)
                     break;
-                if (!AttParse<CharType>(line, from, to, weight, input, output, field_separator))
-                    throw Error("AT&T file at line ", transitions.size() + 1, " is invalid!");
+                if (!AttParse<CharType>(begin, begin + length, from, to, weight, input_view, output_view, field_separator))
+                    throw Error("AT&T file at line ", records.size() + 1, " is invalid!");
 
                 if (previous_state != from)
                 {
-                    if (start_pointers.find(from) != start_pointers.end())
+                    const Index next_state = records.empty() ? state : state + 1;
+                    if (!start_pointers.Insert(from, next_state))
                         // this state has already been visited
-                        throw Error("Transitions are not ordered by starting state! Starting state of transition ", transitions.size() + 1, " has already been visited.");
-                    start_pointers[from] = SaturateCast<Index>::Do(transitions.size());
+                        throw Error("Transitions are not ordered by starting state! Starting state of transition ", records.size() + 1, " has already been visited.");
+                    state = next_state;
                     previous_state = from;
                 }
-                transitions.emplace_back();
+                records.emplace_back();
 
                 if (to != std::numeric_limits<Index>::max())
                 {
+                    input.assign(input_view.first, input_view.second);
+                    output.assign(output_view.first, output_view.second);
                     for (auto s : { &input, &output })
                     {
                         if (StrEqual(s->c_str(), "@0@") || StrEqual(s->c_str(), "@_EPSILON_SYMBOL_@"))
@@ -244,61 +1133,50 @@ public:
                     if (fd_table.IsIt(input.c_str()))
                     {
                         // save these special cases for later
-                        transitions.back().input = std::numeric_limits<Index>::max();
-                        transitions.back().output = flag_hash[output];
+                        records.back().input = std::numeric_limits<Index>::max();
+                        records.back().output = flag_hash[output];
                     }
                     else
                     {
-                        transitions.back().input = alphabet_hash[input];
-                        transitions.back().output = alphabet_hash[output];
+                        records.back().input = alphabet_hash[input];
+                        records.back().output = alphabet_hash[output];
                     }
                 }
-                transitions.back().from = from;
-                transitions.back().to = to;
-                transitions.back().weight = weight;
+                // states are numbered in order of appearance
+                records.back().from = state;
+                records.back().to = to;
+                records.back().weight = weight;
             }
         }
 
-        n_states = start_pointers.size();
-        flag_symbol = SaturateCast<Index>::Do(alphabet_hash.size());
-        for (const auto& flags : flag_hash)
-        {
-            fd_table.Memorize(flags.first.c_str(), alphabet_hash[flags.first]);
-        }
-        CompileAlphabet(alphabet_hash);
-        fd_table.CalculateOffsets();
+        n_states = records.empty() ? start_pointers.size() : size_t(records.back().from) + 1;
+        const auto flag_symbols = CompileSymbols(alphabet_hash, flag_hash);
 
         Index i, j;
-        for (i = 0, j = 0; i < transitions.size(); i = j)
+        for (i = 0, j = 0; i < records.size(); i = j)
         {
-            for (; j < transitions.size() && transitions[j].from == transitions[i].from; ++j)
+            for (; j < records.size() && records[j].from == records[i].from; ++j)
             {
-                auto& t = transitions[j];
+                auto& t = records[j];
                 if (t.to != std::numeric_limits<Index>::max())
                 {   // non-final state
-                    auto it = start_pointers.find(t.to);
-                    if (it != start_pointers.end())
-                        t.to = start_pointers[t.to];
-                    else // dangling edge
-                        t.to = (Index)transitions.size();
+                    const Index* to = start_pointers.Find(t.to);
+                    // or a dangling edge
+                    t.to = to ? *to : (Index)n_states;
                 }
 
                 if (t.input >= flag_symbol)
                 {
-                    for (const auto& flag : flag_hash)
-                    {
-                        // re-find which string is it exactly
-                        if (flag.second == t.output)
-                        {
-                            t.input = alphabet_hash[flag.first];
-                            break;
-                        }
-                    }
+                    t.input = flag_symbols[t.output];
                     fd_table.Compile(t.input, t.output);
                 }
             }
-            std::sort(transitions.begin() + i, transitions.begin() + j);
+            std::sort(records.begin() + i, records.begin() + j);
         }
+        CompileHeaders(records);
+        transitions.Assign(records);
+        CompileHeuristic();
+        CompileTokenizer();
     }
     bool Write(FILE* f, CharType field_separator = '\t')const
     {
@@ -361,239 +1239,731 @@ public:
     }
     bool WriteBinary(FILE* f)const
     {
-        // BOM
-        if (!WriteBom<enc>(f))
+        BinaryFile out(f);
+        return write_binary(out);
+    }
+    bool ReadBinary(FILE* f)
+    {
+        BinaryFile in(f);
+        if (!read_binary(in))
             return false;
-        // storage size info
+        // nothing points into it any more
+        image.reset();
+        return true;
+    }
+    //! uses the binary format in a mapped file without copying it, the file stays mapped while this needs it
+    /*!
+        The vectors are copied into the heap only if they are modified, for example by ReorderStates.
+    */
+    bool MapBinary(const std::shared_ptr<const MappedFile>& file)
+    {
+        // before anything points into it
+        image = file;
+        BinaryImage in(file->GetData(), file->GetSize());
+        return read_binary(in);
+    }
+    bool IsMapped()const { return image != nullptr; }
+    //! puts this under the name as a shared image of the next generation, which is returned
+    /*!
+        The name is a file or a POSIX shared memory object like "/name", see MappedFile::PublishShared.
+        Throws if it cannot be written.
+    */
+    std::uint64_t WriteShared(const std::string& name)const
+    {
+        std::vector<char> format;
+        BinaryBuffer out(format);
+        write_binary(out);
+        return MappedFile::PublishShared(name, format);
+    }
+    //! maps the shared image under the name, see WriteShared and MapBinary
+    /*!
+        Throws if there is no complete image under the name.
+    */
+    bool MapShared(const std::string& name)
+    {
+        return MapBinary(MappedFile::OpenShared(name));
+    }
+    //! the generation of the shared image this is mapped from, zero if it is not
+    /*!
+        A newer image is swapped in by mapping it into an other transducer,
+        if MappedFile::GetSharedGeneration is greater than this.
+    */
+    std::uint64_t GetGeneration()const { return image ? image->GetGeneration() : 0; }
+
+    //! makes this a copy of a transducer with an other storage layout
+    /*!
+        Throws if t has weights and this is UNWEIGHTED.
+    */
+    template<Layout other>
+    void Assign(const Transducer<enc, storageSize, other>& t)
+    {
+        std::vector<Transition> records(t.transitions.size());
+        for (size_t i = 0; i < records.size(); ++i)
+            // the starting states are not needed once the headers are there
+            records[i] = Transition{ 0, t.transitions.GetTo(i), t.transitions.GetInput(i), t.transitions.GetOutput(i), t.transitions.GetWeight(i) };
+        transitions.Assign(records);
+        raw_alphabet = t.raw_alphabet;
+        alphabet = t.alphabet;
+        char_table = t.char_table;
+        CopyBinaryVector(rare_chars, t.rare_chars);
+        CopyBinaryVector(token_nodes, t.token_nodes);
+        CopyBinaryVector(token_edges, t.token_edges);
+        sorted_symbols = t.sorted_symbols;
+        CopyBinaryVector(headers, t.headers);
+        dispatch_table = t.dispatch_table;
+        heuristic = t.heuristic;
+        n_states = t.n_states;
+        fd_table = t.fd_table;
+        unknown_symbol = t.unknown_symbol;
+        identity_symbol = t.identity_symbol;
+        empty_symbol = t.empty_symbol;
+        flag_symbol = t.flag_symbol;
+        image = t.image;
+    }
+    //! the states in breadth first order from the start state, the transitions of a state are followed in their order
+    /*!
+        The states which cannot be reached from the start state are not listed.
+    */
+    std::vector<Index> GetBreadthFirstOrder()const
+    {
+        std::vector<bool> visited(n_states + 1, false);
+        std::vector<Index> order;
+        order.reserve(n_states);
+        if (n_states == 0)
+            return order;
+        visited[0] = true;
+        order.push_back(0);
+        // the order is the queue itself
+        for (size_t k = 0; k < order.size(); ++k)
         {
-            const Index width = storageSize;
-            if (fwrite(&width, sizeof(Index), 1, f) != 1)
-                return false;
+            const auto& h = headers[order[k]];
+            for (Index i = h.epsilons; i < h.end; ++i)
+            {
+                const Index to = transitions.GetTo(i);
+                if (!visited[to])
+                {
+                    visited[to] = true;
+                    // the dangling edges lead to n_states, that is not a real state
+                    if (to < n_states)
+                        order.push_back(to);
+                }
+            }
         }
-        // alphabet
+        return order;
+    }
+    //! the states in decreasing order of how many times they were entered, ties in their original order
+    /*!
+        transition_hits is a profile of this transducer, see LookupContext::profile.
+        The start state is always the first.
+    */
+    std::vector<Index> GetFrequencyOrder(const std::vector<size_t>& transition_hits)const
+    {
+        if (transition_hits.size() != transitions.size())
+            throw Error("The profile has ", transition_hits.size(), " transitions, but the transducer has ", transitions.size(), "!");
+        std::vector<size_t> state_hits(n_states + 1, 0);
+        for (size_t i = 0; i < transitions.size(); ++i)
+            if (transitions.GetTo(i) != std::numeric_limits<Index>::max())
+                state_hits[transitions.GetTo(i)] += transition_hits[i];
+        std::vector<Index> order;
+        order.reserve(n_states);
+        for (Index state = 1; state < n_states; ++state)
+            order.push_back(state);
+        std::stable_sort(order.begin(), order.end(), [&state_hits](Index a, Index b)
         {
-            if (!WriteBinaryVector(f, raw_alphabet))
-                return false;
-            if (!WriteBinaryVector(f, alphabet))
-                return false;
-        }
-        if (!fd_table.Write(f))
-            return false;
-        
-        if (fwrite(&unknown_symbol, sizeof(Index), 1, f) != 1)
-            return false;
-        if (fwrite(&identity_symbol, sizeof(Index), 1, f) != 1)
-            return false;
-        if (fwrite(&empty_symbol, sizeof(Index), 1, f) != 1)
-            return false;
-        if (fwrite(&flag_symbol, sizeof(Index), 1, f) != 1)
-            return false;
-
-        // transitions themselves
-        return WriteBinaryVector(f, transitions);
+            return state_hits[a] > state_hits[b];
+        });
+        if (n_states > 0)
+            order.insert(order.begin(), 0);
+        return order;
     }
-    bool ReadBinary(FILE* f)
+    //! renumbers the states so that order[k] becomes the k-th state, their transitions are moved accordingly
+    /*!
+        The states which are not in order are put after the others, in their original order.
+        The start state has to stay the first.
+        Only the transition IDs change, the results of the lookups and their order remain the same.
+    */
+    void ReorderStates(const std::vector<Index>& order)
     {
-        n_states = 0;
-        // BOM
-        if (!CheckBom<enc>(f))
-            return false;
-        // storage size info
+        const Index none = std::numeric_limits<Index>::max();
+        std::vector<Index> new_state(n_states + 1, none), old_state;
+        old_state.reserve(n_states);
+        for (const auto state : order)
         {
-            Index width;
-            if (fread(&width, sizeof(Index), 1, f) != 1)
-                return false;
-            if (width != storageSize)
-                return false;
+            if (state < n_states && new_state[state] == none)
+            {
+                new_state[state] = Index(old_state.size());
+                old_state.push_back(state);
+            }
         }
-        // alphabet
+        for (Index state = 0; state < n_states; ++state)
         {
-            if (!ReadBinaryVector(f, raw_alphabet))
-                return false;
-            if (!ReadBinaryVector(f, alphabet))
-                return false;
+            if (new_state[state] == none)
+            {
+                new_state[state] = Index(old_state.size());
+                old_state.push_back(state);
+            }
         }
-        if (!fd_table.Read(f))
-            return false;
-
-        if (fread(&unknown_symbol, sizeof(Index), 1, f) != 1)
-            return false;
-        if (fread(&identity_symbol, sizeof(Index), 1, f) != 1)
-            return false;
-        if (fread(&empty_symbol, sizeof(Index), 1, f) != 1)
-            return false;
-        if (fread(&flag_symbol, sizeof(Index), 1, f) != 1)
-            return false;
+        new_state[n_states] = Index(n_states);
+        if (n_states > 0 && new_state[0] != 0)
+            throw Error("The start state cannot be reordered, it has to stay the first!");
 
-        reverse_alphabet_map.clear();
-        for (Index i = 0; i < alphabet.size(); ++i)
+        std::vector<Transition> records;
+        records.reserve(transitions.size());
+        for (Index state = 0; state < n_states; ++state)
+        {
+            const auto& h = headers[old_state[state]];
+            for (Index i = h.finals; i < h.end; ++i)
+            {
+                const Index to = transitions.GetTo(i);
+                records.push_back(Transition{ state, to == none ? to : new_state[to],
+                    transitions.GetInput(i), transitions.GetOutput(i), transitions.GetWeight(i) });
+            }
+        }
+        if (!heuristic.empty())
         {
-            reverse_alphabet_map[GetSymbolStr(i)] = i;
+            const std::vector<Float> old_heuristic(heuristic.begin(), heuristic.end());
+            for (Index state = 0; state <= n_states; ++state)
+                heuristic[new_state[state]] = old_heuristic[state];
         }
-        return ReadBinaryVector(f, transitions);
+        CompileHeaders(records);
+        transitions.Assign(records);
+    }
+    //! whether any transition has a non-zero weight
+    bool HasWeights()const
+    {
+        for (size_t i = 0; i < transitions.size(); ++i)
+            if (transitions.GetWeight(i) != 0)
+                return true;
+        return false;
     }
-
     //! including to finishing from a final state
     size_t GetNumberOfTransitions()const { return transitions.size(); }
     //! including start state
     size_t GetNumberOfStates()const { return n_states; }
     size_t GetAllocatedMemory()const
     {
-        return sizeof(Transition) * transitions.size() +
+        return transitions.GetAllocatedMemory() +
+            sizeof(StateHeader) * headers.size() +
+            sizeof(Index) * dispatch_table.size() +
+            sizeof(Float) * heuristic.size() +
             sizeof(Index) * alphabet.size() +
+            sizeof(Index) * char_table.size() +
+            sizeof(CharSymbol) * rare_chars.size() +
+            sizeof(TokenNode) * token_nodes.size() +
+            sizeof(TokenEdge) * token_edges.size() +
             sizeof(CharType) * raw_alphabet.size();
     }
 
-    size_t max_results;
-    size_t max_depth;
-    double time_limit;
-    std::function<void(const Path& path)> resulthandler;
-
     template<FlagStrategy strategy = FlagStrategy::OBEY, bool check_limits = false>
-    void Lookup(const CharType* s)
+    void Lookup(LookupContext& ctx, const CharType* s)const
+    {
+        return Lookup<strategy, check_limits>(ctx, s, ctx.resulthandler);
+    }
+    //! the results are handed to sink(const Path&) instead of the resulthandler
+    /*!
+        The call of the sink can be inlined, unlike the call of a std::function.
+    */
+    template<FlagStrategy strategy, bool check_limits, class Sink>
+    void Lookup(LookupContext& ctx, const CharType* s, Sink& sink)const
     {
-        Segment(s, input_tape);
-        n_results = 0;
-        myclock.Tick();
-        flag_failed = false;
-        return lookup<strategy, check_limits>(0);
+        Segment(s, ctx.input_tape);
+        ctx.path.clear();
+        ctx.input_tape_pos = 0;
+        ctx.n_results = 0;
+        ctx.StartClock();
+        ctx.flag_failed = false;
+        ctx.dead_ends.clear();
+        if (ctx.profile)
+            ctx.transition_hits.resize(transitions.size(), 0);
+        return lookup<strategy, check_limits>(ctx, sink, 0);
     }
     template<bool check_limits = false>
-    void Lookup(const CharType* s, FlagStrategy strategy)
+    void Lookup(LookupContext& ctx, const CharType* s, FlagStrategy strategy)const
     {
         switch (strategy)
         {
         case FlagStrategy::IGNORE:
-            return Lookup<IGNORE, check_limits>(s);
+            return Lookup<IGNORE, check_limits>(ctx, s);
         case FlagStrategy::NEGATIVE:
-            return Lookup<NEGATIVE, check_limits>(s);
+            return Lookup<NEGATIVE, check_limits>(ctx, s);
         default:
-            return Lookup<OBEY, check_limits>(s);
+            return Lookup<OBEY, check_limits>(ctx, s);
+        };
+    }
+    //! looks up several words at once, the common prefixes of the words are searched only once
+    /*!
+        The words are put into a trie, which is walked together with the transducer.
+        resulthandler is called like in Lookup, and GetWord() tells which word the path belongs to.
+        Every word gets the same results in the same order as with Lookup,
+        max_results and max_depth are per word, but time_limit is for the whole batch.
+    */
+    template<FlagStrategy strategy = FlagStrategy::OBEY, bool check_limits = false>
+    void LookupBatch(LookupContext& ctx, const std::vector<const CharType*>& words)const
+    {
+        BuildTrie(ctx, words);
+        ctx.word_results.assign(words.size(), 0);
+        ctx.path.clear();
+        ctx.StartClock();
+        ctx.flag_failed = false;
+        ctx.dead_ends.clear();
+        return lookup_batch<strategy, check_limits>(ctx, 0, 0);
+    }
+    template<bool check_limits = false>
+    void LookupBatch(LookupContext& ctx, const std::vector<const CharType*>& words, FlagStrategy strategy)const
+    {
+        switch (strategy)
+        {
+        case FlagStrategy::IGNORE:
+            return LookupBatch<IGNORE, check_limits>(ctx, words);
+        case FlagStrategy::NEGATIVE:
+            return LookupBatch<NEGATIVE, check_limits>(ctx, words);
+        default:
+            return LookupBatch<OBEY, check_limits>(ctx, words);
+        };
+    }
+    //! like Lookup, but the results are reported in increasing order of weight
+    /*!
+        Partial paths are expanded in the order of their weight plus the least possible remaining weight
+        (A* search), so if max_results is set,
+        then the search stops as soon as the best max_results analyses are found.
+        Paths that cannot reach a final state are not followed at all.
+        The order is exact, unless the heuristic could not be calculated and there are negative weights.
+    */
+    template<FlagStrategy strategy = FlagStrategy::OBEY, bool check_limits = false>
+    void LookupBest(LookupContext& ctx, const CharType* s)const
+    {
+        return LookupBest<strategy, check_limits>(ctx, s, ctx.resulthandler);
+    }
+    template<FlagStrategy strategy, bool check_limits, class Sink>
+    void LookupBest(LookupContext& ctx, const CharType* s, Sink& sink)const
+    {
+        typedef typename LookupContext::SearchNode SearchNode;
+        typedef std::pair<Float, size_t> QueueItem;
+        Segment(s, ctx.input_tape);
+        ctx.n_results = 0;
+        ctx.StartClock();
+        ctx.nodes.clear();
+        ctx.queue.clear();
+        ctx.nodes.push_back(SearchNode{ PathValue(GetSymbolStr(empty_symbol), GetSymbolStr(empty_symbol), 0, 0, 0, FlagState()),
+            0, 0, 0, 0, 0, false, false });
+        if (GetHeuristic(0) == std::numeric_limits<Float>::infinity())
+            return;
+        ctx.queue.emplace_back(GetHeuristic(0), size_t(0));
+        while (!ctx.queue.empty())
+        {
+            if (check_limits &&
+                ((ctx.max_results > 0 && ctx.n_results >= ctx.max_results) ||
+                ctx.TimeIsUp()))
+            {
+                break;
+            }
+            std::pop_heap(ctx.queue.begin(), ctx.queue.end(), std::greater<QueueItem>());
+            const size_t n = ctx.queue.back().second;
+            ctx.queue.pop_back();
+            if (ctx.nodes[n].final)
+            {
+                ctx.path.clear();
+                for (size_t m = n; m != 0; m = ctx.nodes[m].parent)
+                    ctx.path.push_back(ctx.nodes[m].step);
+                std::reverse(ctx.path.begin(), ctx.path.end());
+                ++ctx.n_results;
+                sink(ctx.path);
+            }
+            else if (!check_limits || ctx.max_depth == 0 || ctx.nodes[n].depth < ctx.max_depth)
+            {
+                expand<strategy>(ctx, n);
+            }
+        }
+        ctx.path.clear();
+    }
+    template<bool check_limits = false>
+    void LookupBest(LookupContext& ctx, const CharType* s, FlagStrategy strategy)const
+    {
+        switch (strategy)
+        {
+        case FlagStrategy::IGNORE:
+            return LookupBest<IGNORE, check_limits>(ctx, s);
+        case FlagStrategy::NEGATIVE:
+            return LookupBest<NEGATIVE, check_limits>(ctx, s);
+        default:
+            return LookupBest<OBEY, check_limits>(ctx, s);
         };
     }
 private:
     void Segment(const CharType* s, std::vector<Index>& inputtape)const
     {
         inputtape.clear();
-        for (; *s; StepNextCharacter<enc>(s))
+        for (const CharType* next = s; *s; s = next)
         {
-            const string letter(s, GetNextCharacter<enc>(s));
-            const auto it = reverse_alphabet_map.find(letter);
-            if (it != reverse_alphabet_map.end())
-                inputtape.emplace_back(it->second);
+            if (!token_nodes.empty())
+            {   // the longest multi-character symbol from here, which ends on a character boundary
+                Index node = 0, symbol = std::numeric_limits<Index>::max();
+                for (const CharType* c = s; *c && node != std::numeric_limits<Index>::max(); )
+                {
+                    for (const CharType* const end = GetNextCharacter<enc>(c); c < end && node != std::numeric_limits<Index>::max(); ++c)
+                        node = TokenChild(node, *c);
+                    if (node != std::numeric_limits<Index>::max() && token_nodes[node].symbol != std::numeric_limits<Index>::max())
+                    {
+                        symbol = token_nodes[node].symbol;
+                        next = c;
+                    }
+                }
+                if (symbol != std::numeric_limits<Index>::max())
+                {
+                    inputtape.emplace_back(symbol);
+                    continue;
+                }
+            }
+            next = GetNextCharacter<enc>(s);
+            std::uint32_t code_point;
+            if (DecodeCharacter<enc>(s, next, code_point))
+            {
+                if (code_point < char_table.size())
+                    inputtape.emplace_back(char_table[code_point]);
+                else
+                {
+                    const auto it = std::lower_bound(rare_chars.begin(), rare_chars.end(), code_point,
+                        [](const CharSymbol& a, std::uint32_t b) { return a.code_point < b; });
+                    inputtape.emplace_back(it != rare_chars.end() && it->code_point == code_point ? it->symbol : unknown_symbol);
+                }
+            }
             else
-                inputtape.emplace_back(unknown_symbol);
+            {   // malformed characters are rare enough
+                const Index symbol = FindSymbol(s, next);
+                inputtape.emplace_back(symbol != std::numeric_limits<Index>::max() ? symbol : unknown_symbol);
+            }
         }
     }
-    template<FlagStrategy strategy, bool check_limits>
-    void lookup(Index i)
+    template<FlagStrategy strategy, bool check_limits, class Sink>
+    void lookup(LookupContext& ctx, Sink& sink, Index state)const
     {
+        if (ctx.profile && !ctx.path.empty())
+            // the transition which led here
+            ++ctx.transition_hits[ctx.path.back().GetId()];
         if (check_limits)
         {
-            if ((max_results > 0 && n_results >= max_results) ||
-                (max_depth > 0 && path.size() >= max_depth) ||
-                (time_limit > 0 && myclock.Tock() >= time_limit))
+            if ((ctx.max_results > 0 && ctx.n_results >= ctx.max_results) ||
+                (ctx.max_depth > 0 && ctx.path.size() >= ctx.max_depth) ||
+                ctx.TimeIsUp())
+            {
+                ++ctx.n_cutoffs;
+                return;
+            }
+        }
+        const auto flag_state = ctx.path.empty() ? FlagState() : ctx.path.back().GetFlag();
+        typename LookupContext::Configuration configuration;
+        size_t n_found = 0, n_cutoffs = 0;
+        if (ctx.dead_end_memo)
+        {
+            configuration = { state, ctx.input_tape_pos, flag_state.GetRaw(), strategy == NEGATIVE && ctx.flag_failed };
+            if (ctx.dead_ends.find(configuration) != ctx.dead_ends.end())
             {
+                ++ctx.dead_end_hits;
                 return;
             }
+            n_found = ctx.n_found;
+            n_cutoffs = ctx.n_cutoffs;
         }
-        const auto flag_state = path.empty() ? FlagState() : path.back().GetFlag();
-        const auto state = transitions[i].from;
-        if (input_tape_pos == input_tape.size() && (strategy != NEGATIVE || flag_failed))
+        const auto& h = headers[state];
+        Index i;
+        if (ctx.input_tape_pos == ctx.input_tape.size() && (strategy != NEGATIVE || ctx.flag_failed))
         {   // try final transitions
-            for (; i < transitions.size() &&
-                transitions[i].from == state &&
-                transitions[i].to == std::numeric_limits<Index>::max();
-                ++i)
+            for (i = h.finals; i < h.epsilons; ++i)
             {   //final transition
                 if (check_limits)
-                    ++n_results;
-                path.emplace_back(GetSymbolStr(empty_symbol), GetSymbolStr(empty_symbol), i, state, transitions[i].weight, flag_state);
-                resulthandler(path);
-                path.pop_back();
-            }
-        }
-        else
-        {   // skip final transitions
-            // TODO logarithmic ?
-            while (i < transitions.size() &&
-                transitions[i].from == state &&
-                transitions[i].to == std::numeric_limits<Index>::max())
-            {
-                ++i;
+                    ++ctx.n_results;
+                ++ctx.n_found;
+                if (ctx.profile)
+                    ++ctx.transition_hits[i];
+                ctx.path.emplace_back(GetSymbolStr(empty_symbol), GetSymbolStr(empty_symbol), i, state, transitions.GetWeight(i), flag_state);
+                sink(ctx.path);
+                ctx.path.pop_back();
             }
         }
         // try epsilon transitions
-        for (; i < transitions.size() &&
-            transitions[i].from == state &&
-            transitions[i].input == empty_symbol;
-            ++i)
+        for (i = h.epsilons; i < h.flags; ++i)
         {
-            path.emplace_back(GetSymbolStr(empty_symbol), GetSymbolStr(transitions[i].output), i, state, transitions[i].weight, flag_state);
-            lookup<strategy, check_limits>(transitions[i].to);
-            path.pop_back();
+            ctx.path.emplace_back(GetSymbolStr(empty_symbol), GetSymbolStr(transitions.GetOutput(i)), i, state, transitions.GetWeight(i), flag_state);
+            lookup<strategy, check_limits>(ctx, sink, transitions.GetTo(i));
+            ctx.path.pop_back();
         }
         // try diacritic flags
-        for (; i < transitions.size() &&
-            transitions[i].from == state &&
-            transitions[i].input >= flag_symbol;
-            ++i)
+        for (i = h.flags; i < h.normals; ++i)
         {
             if (strategy == IGNORE)
             {   // go with it, no matter what
-                path.emplace_back(GetSymbolStr(transitions[i].input), GetSymbolStr(transitions[i].input), i, state, transitions[i].weight, flag_state);
-                lookup<strategy, check_limits>(transitions[i].to);
-                path.pop_back();
+                ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetInput(i)), i, state, transitions.GetWeight(i), flag_state);
+                lookup<strategy, check_limits>(ctx, sink, transitions.GetTo(i));
+                ctx.path.pop_back();
             }
             else
             {
                 auto new_flag_state = flag_state;
-                if (fd_table.Apply(transitions[i].output, new_flag_state))
+                if (fd_table.Apply(transitions.GetOutput(i), new_flag_state))
                 {
-                    path.emplace_back(GetSymbolStr(transitions[i].input), GetSymbolStr(transitions[i].input), i, state, transitions[i].weight, new_flag_state);
-                    lookup<strategy, check_limits>(transitions[i].to);
-                    path.pop_back();
+                    ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetInput(i)), i, state, transitions.GetWeight(i), new_flag_state);
+                    lookup<strategy, check_limits>(ctx, sink, transitions.GetTo(i));
+                    ctx.path.pop_back();
                 }
                 else if (strategy == NEGATIVE)
                 {
-                    const bool previous_fail = flag_failed;
-                    flag_failed = true;
-                    path.emplace_back(GetSymbolStr(transitions[i].input), GetSymbolStr(transitions[i].input), i, state, transitions[i].weight, new_flag_state);
-                    lookup<strategy, check_limits>(transitions[i].to);
-                    path.pop_back();
-                    flag_failed = previous_fail;
+                    const bool previous_fail = ctx.flag_failed;
+                    ctx.flag_failed = true;
+                    ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetInput(i)), i, state, transitions.GetWeight(i), new_flag_state);
+                    lookup<strategy, check_limits>(ctx, sink, transitions.GetTo(i));
+                    ctx.path.pop_back();
+                    ctx.flag_failed = previous_fail;
                 }
             }
         }
         // try only if there is any symbol left to read
-        if (input_tape_pos < input_tape.size())
+        if (ctx.input_tape_pos < ctx.input_tape.size())
         {   // normal transitions
-            // TODO binary-search
-            for (; i < transitions.size() &&
-                transitions[i].from == state &&
-                transitions[i].input != unknown_symbol &&
-                transitions[i].input != identity_symbol;
-                ++i)
-            {
-                if (input_tape[input_tape_pos] == transitions[i].input)
-                {   // a lead to follow
-                    path.emplace_back(GetSymbolStr(transitions[i].input), GetSymbolStr(transitions[i].output), i, state, transitions[i].weight, flag_state);
-                    ++input_tape_pos;
-                    lookup<strategy, check_limits>(transitions[i].to);
-                    --input_tape_pos;
-                    path.pop_back();
-                }
+            Index end;
+            for (FindNormal(h, ctx.input_tape[ctx.input_tape_pos], i, end); i < end; ++i)
+            {   // a lead to follow
+                ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetOutput(i)), i, state, transitions.GetWeight(i), flag_state);
+                ++ctx.input_tape_pos;
+                lookup<strategy, check_limits>(ctx, sink, transitions.GetTo(i));
+                --ctx.input_tape_pos;
+                ctx.path.pop_back();
             }
             // id/unk transitions, always fallow
-            for (; i < transitions.size() && transitions[i].from == state; ++i)
+            for (i = h.specials; i < h.end; ++i)
             {
-                path.emplace_back(GetSymbolStr(transitions[i].input), GetSymbolStr(transitions[i].output), i, state, transitions[i].weight, flag_state);
-                ++input_tape_pos;
-                lookup<strategy, check_limits>(transitions[i].to);
-                --input_tape_pos;
-                path.pop_back();
+                ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetOutput(i)), i, state, transitions.GetWeight(i), flag_state);
+                ++ctx.input_tape_pos;
+                lookup<strategy, check_limits>(ctx, sink, transitions.GetTo(i));
+                --ctx.input_tape_pos;
+                ctx.path.pop_back();
             }
         }
+        // a subtree which was cut short by a limit is not proven to be empty
+        if (ctx.dead_end_memo && ctx.n_found == n_found && ctx.n_cutoffs == n_cutoffs)
+        {
+            ctx.dead_ends.insert(configuration);
+            ++ctx.dead_end_entries;
+        }
+    }
+    void BuildTrie(LookupContext& ctx, const std::vector<const CharType*>& words)const
+    {
+        typedef typename LookupContext::TrieNode TrieNode;
+        ctx.batch_symbols.clear();
+        ctx.batch_offsets.assign(1, 0);
+        for (const auto word : words)
+        {
+            Segment(word, ctx.input_tape);
+            ctx.batch_symbols.insert(ctx.batch_symbols.end(), ctx.input_tape.begin(), ctx.input_tape.end());
+            ctx.batch_offsets.push_back(ctx.batch_symbols.size());
+        }
+        const auto begin = [&ctx](Index w) { return ctx.batch_symbols.begin() + ctx.batch_offsets[w]; };
+        const auto end = [&ctx](Index w) { return ctx.batch_symbols.begin() + ctx.batch_offsets[w + 1]; };
+        ctx.trie_words.resize(words.size());
+        for (Index w = 0; w < ctx.trie_words.size(); ++w)
+            ctx.trie_words[w] = w;
+        std::sort(ctx.trie_words.begin(), ctx.trie_words.end(), [&](Index a, Index b)
+        {
+            return std::lexicographical_compare(begin(a), end(a), begin(b), end(b));
+        });
+        const Index n = SaturateCast<Index>::Do(words.size());
+        ctx.trie.assign(1, TrieNode{ 0, 0, 0, 0, 0, 0, n, n });
+        // breadth first, so that the children of a node are created one after the other
+        for (Index node = 0; node < ctx.trie.size(); ++node)
+        {
+            // until now words_end marks the end of the whole subtree
+            const Index depth = ctx.trie[node].depth;
+            const Index subtree_end = ctx.trie[node].words_end;
+            Index w = ctx.trie[node].words;
+            for (; w < subtree_end && size_t(end(ctx.trie_words[w]) - begin(ctx.trie_words[w])) == depth; ++w);
+            ctx.trie[node].words_end = w;
+            ctx.trie[node].children = Index(ctx.trie.size());
+            while (w < subtree_end)
+            {
+                const Index symbol = begin(ctx.trie_words[w])[depth];
+                const Index first = w;
+                for (; w < subtree_end && begin(ctx.trie_words[w])[depth] == symbol; ++w);
+                ctx.trie.push_back(TrieNode{ symbol, node, depth + 1, 0, 0, first, w, w - first });
+            }
+            ctx.trie[node].children_end = Index(ctx.trie.size());
+        }
+    }
+    //! the same as lookup, but the input tape is a trie of words
+    template<FlagStrategy strategy, bool check_limits>
+    void lookup_batch(LookupContext& ctx, Index state, Index node)const
+    {
+        if (check_limits)
+        {
+            if ((ctx.max_results > 0 && ctx.trie[node].open == 0) ||
+                (ctx.max_depth > 0 && ctx.path.size() >= ctx.max_depth) ||
+                ctx.TimeIsUp())
+            {
+                ++ctx.n_cutoffs;
+                return;
+            }
+        }
+        const auto flag_state = ctx.path.empty() ? FlagState() : ctx.path.back().GetFlag();
+        typename LookupContext::Configuration configuration;
+        size_t n_found = 0, n_cutoffs = 0;
+        if (ctx.dead_end_memo)
+        {
+            configuration = { state, node, flag_state.GetRaw(), strategy == NEGATIVE && ctx.flag_failed };
+            if (ctx.dead_ends.find(configuration) != ctx.dead_ends.end())
+            {
+                ++ctx.dead_end_hits;
+                return;
+            }
+            n_found = ctx.n_found;
+            n_cutoffs = ctx.n_cutoffs;
+        }
+        const auto& h = headers[state];
+        // ctx.trie does not grow during the lookup, so references are fine
+        const auto& trie_node = ctx.trie[node];
+        Index i;
+        if (trie_node.words < trie_node.words_end && (strategy != NEGATIVE || ctx.flag_failed))
+        {   // try final transitions for the words ending here
+            for (Index w = trie_node.words; w < trie_node.words_end; ++w)
+            {
+                ctx.word = ctx.trie_words[w];
+                auto& n_results = ctx.word_results[ctx.word];
+                // like in lookup, the limit is checked before the final transitions, not between them
+                if (check_limits && ctx.max_results > 0 && n_results >= ctx.max_results)
+                    continue;
+                for (i = h.finals; i < h.epsilons; ++i)
+                {
+                    ++n_results;
+                    ++ctx.n_found;
+                    ctx.path.emplace_back(GetSymbolStr(empty_symbol), GetSymbolStr(empty_symbol), i, state, transitions.GetWeight(i), flag_state);
+                    ctx.resulthandler(ctx.path);
+                    ctx.path.pop_back();
+                }
+                if (check_limits && ctx.max_results > 0 && n_results >= ctx.max_results)
+                {   // this word needs no more results
+                    for (Index m = node; ; m = ctx.trie[m].parent)
+                    {
+                        --ctx.trie[m].open;
+                        if (m == 0)
+                            break;
+                    }
+                }
+            }
+        }
+        // try epsilon transitions
+        for (i = h.epsilons; i < h.flags; ++i)
+        {
+            ctx.path.emplace_back(GetSymbolStr(empty_symbol), GetSymbolStr(transitions.GetOutput(i)), i, state, transitions.GetWeight(i), flag_state);
+            lookup_batch<strategy, check_limits>(ctx, transitions.GetTo(i), node);
+            ctx.path.pop_back();
+        }
+        // try diacritic flags
+        for (i = h.flags; i < h.normals; ++i)
+        {
+            if (strategy == IGNORE)
+            {
+                ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetInput(i)), i, state, transitions.GetWeight(i), flag_state);
+                lookup_batch<strategy, check_limits>(ctx, transitions.GetTo(i), node);
+                ctx.path.pop_back();
+            }
+            else
+            {
+                auto new_flag_state = flag_state;
+                if (fd_table.Apply(transitions.GetOutput(i), new_flag_state))
+                {
+                    ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetInput(i)), i, state, transitions.GetWeight(i), new_flag_state);
+                    lookup_batch<strategy, check_limits>(ctx, transitions.GetTo(i), node);
+                    ctx.path.pop_back();
+                }
+                else if (strategy == NEGATIVE)
+                {
+                    const bool previous_fail = ctx.flag_failed;
+                    ctx.flag_failed = true;
+                    ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetInput(i)), i, state, transitions.GetWeight(i), new_flag_state);
+                    lookup_batch<strategy, check_limits>(ctx, transitions.GetTo(i), node);
+                    ctx.path.pop_back();
+                    ctx.flag_failed = previous_fail;
+                }
+            }
+        }
+        // every word reads its own next symbol, the order of the results of one word is the same as in lookup
+        for (Index child = trie_node.children; child < trie_node.children_end; ++child)
+        {   // normal transitions
+            Index end;
+            for (FindNormal(h, ctx.trie[child].symbol, i, end); i < end; ++i)
+            {
+                ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetOutput(i)), i, state, transitions.GetWeight(i), flag_state);
+                lookup_batch<strategy, check_limits>(ctx, transitions.GetTo(i), child);
+                ctx.path.pop_back();
+            }
+        }
+        for (Index child = trie_node.children; child < trie_node.children_end; ++child)
+        {   // id/unk transitions
+            for (i = h.specials; i < h.end; ++i)
+            {
+                ctx.path.emplace_back(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetOutput(i)), i, state, transitions.GetWeight(i), flag_state);
+                lookup_batch<strategy, check_limits>(ctx, transitions.GetTo(i), child);
+                ctx.path.pop_back();
+            }
+        }
+        if (ctx.dead_end_memo && ctx.n_found == n_found && ctx.n_cutoffs == n_cutoffs)
+        {
+            ctx.dead_ends.insert(configuration);
+            ++ctx.dead_end_entries;
+        }
+    }
+    Float GetHeuristic(Index state)const
+    {
+        return heuristic.empty() ? Float(0) : heuristic[state];
+    }
+    //! pushes the continuations of a partial path into the queue of the best-first search
+    template<FlagStrategy strategy>
+    void expand(LookupContext& ctx, size_t n)const
+    {
+        typedef typename LookupContext::SearchNode SearchNode;
+        typedef std::pair<Float, size_t> QueueItem;
+        // ctx.nodes grows below, so no references
+        const SearchNode node = ctx.nodes[n];
+        const auto flag_state = node.step.GetFlag();
+        const auto& h = headers[node.state];
+        auto push = [&](const PathValue& step, Index to, Index input_tape_pos, bool flag_failed, bool final)
+        {
+            const Float remaining = final ? Float(0) : GetHeuristic(to);
+            if (remaining == std::numeric_limits<Float>::infinity())
+                // dead end
+                return;
+            const Float weight = node.weight + step.GetWeight();
+            ctx.nodes.push_back(SearchNode{ step, n, weight, to, input_tape_pos, node.depth + 1, flag_failed, final });
+            ctx.queue.emplace_back(weight + remaining, ctx.nodes.size() - 1);
+            std::push_heap(ctx.queue.begin(), ctx.queue.end(), std::greater<QueueItem>());
+        };
+        Index i;
+        if (node.input_tape_pos == ctx.input_tape.size() && (strategy != NEGATIVE || node.flag_failed))
+        {
+            for (i = h.finals; i < h.epsilons; ++i)
+                push(PathValue(GetSymbolStr(empty_symbol), GetSymbolStr(empty_symbol), i, node.state, transitions.GetWeight(i), flag_state),
+                    node.state, node.input_tape_pos, node.flag_failed, true);
+        }
+        for (i = h.epsilons; i < h.flags; ++i)
+            push(PathValue(GetSymbolStr(empty_symbol), GetSymbolStr(transitions.GetOutput(i)), i, node.state, transitions.GetWeight(i), flag_state),
+                transitions.GetTo(i), node.input_tape_pos, node.flag_failed, false);
+        for (i = h.flags; i < h.normals; ++i)
+        {
+            auto new_flag_state = flag_state;
+            if (strategy == IGNORE || fd_table.Apply(transitions.GetOutput(i), new_flag_state))
+                push(PathValue(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetInput(i)), i, node.state, transitions.GetWeight(i), strategy == IGNORE ? flag_state : new_flag_state),
+                    transitions.GetTo(i), node.input_tape_pos, node.flag_failed, false);
+            else if (strategy == NEGATIVE)
+                push(PathValue(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetInput(i)), i, node.state, transitions.GetWeight(i), new_flag_state),
+                    transitions.GetTo(i), node.input_tape_pos, true, false);
+        }
+        if (node.input_tape_pos < ctx.input_tape.size())
+        {
+            Index end;
+            for (FindNormal(h, ctx.input_tape[node.input_tape_pos], i, end); i < end; ++i)
+                push(PathValue(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetOutput(i)), i, node.state, transitions.GetWeight(i), flag_state),
+                    transitions.GetTo(i), node.input_tape_pos + 1, node.flag_failed, false);
+            for (i = h.specials; i < h.end; ++i)
+                push(PathValue(GetSymbolStr(transitions.GetInput(i)), GetSymbolStr(transitions.GetOutput(i)), i, node.state, transitions.GetWeight(i), flag_state),
+                    transitions.GetTo(i), node.input_tape_pos + 1, node.flag_failed, false);
+        }
     }
 };
 
@@ -11,6 +11,15 @@
 #include <utility>
 #include <list>
 #include <functional>
+#include <vector>
+#include <cstdio>
+#include <algorithm>
+
+#ifdef WIN32
+# include <io.h>
+#else
+# include <unistd.h>
+#endif
 
 namespace attol{
 
@@ -170,6 +179,210 @@ public:
     }
 };
 
+//! a map between unsigned integers, the keys which are not much larger than the number of keys are looked up in a vector
+/*!
+    Meant for the state numbers of an AT&T file, which are usually 0, 1, 2...; the others go to a hash table.
+    The max value of Value is reserved.
+*/
+template<class Key, class Value>
+class IndexMap
+{
+public:
+    IndexMap()
+        : n(0)
+    {
+    }
+    //! nullptr if the key is not there
+    const Value* Find(Key key)const
+    {
+        if (key < dense.size() && dense[key] != std::numeric_limits<Value>::max())
+            return &dense[key];
+        if (sparse.empty())
+            return nullptr;
+        const auto it = sparse.find(key);
+        return it == sparse.end() ? nullptr : &it->second;
+    }
+    //! returns false and does nothing if the key is already there
+    bool Insert(Key key, Value value)
+    {
+        if (Find(key))
+            return false;
+        ++n;
+        if (key < dense.size())
+        {
+            dense[key] = value;
+            return true;
+        }
+        if (key / 2 >= n + 512)
+        {
+            sparse.emplace(key, value);
+            return true;
+        }
+        // the dense part grows with the number of keys
+        std::vector<Value> grown(std::max<size_t>(size_t(key) + 1, 2 * dense.size()), std::numeric_limits<Value>::max());
+        std::copy(dense.begin(), dense.end(), grown.begin());
+        grown[key] = value;
+        dense.swap(grown);
+        return true;
+    }
+    size_t size()const { return n; }
+private:
+    std::vector<Value> dense;
+    std::unordered_map<Key, Value> sparse;
+    size_t n;
+};
+
+//! a string to string map with a memory cap, the least recently used entries are evicted first
+/*!
+    The memory usage is estimated from the length of the strings and a fixed overhead per entry.
+    A zero cap means that nothing is stored.
+*/
+template<class Key, class Value>
+class LruCache
+{
+public:
+    explicit LruCache(size_t max_bytes = 0)
+        : max_bytes(max_bytes), bytes(0), hits(0), misses(0), evictions(0)
+    {
+    }
+    //! returns nullptr if the key is not stored, the pointer is valid until the next Insert
+    const Value* Find(const Key& key)
+    {
+        const auto it = index.find(key);
+        if (it == index.end())
+        {
+            ++misses;
+            return nullptr;
+        }
+        ++hits;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
+    void Insert(const Key& key, const Value& value)
+    {
+        const size_t size = Size(key, value);
+        if (size > max_bytes || index.find(key) != index.end())
+            return;
+        while (bytes + size > max_bytes)
+        {
+            const auto& last = entries.back();
+            bytes -= Size(last.first, last.second);
+            index.erase(last.first);
+            entries.pop_back();
+            ++evictions;
+        }
+        entries.emplace_front(key, value);
+        index.emplace(key, entries.begin());
+        bytes += size;
+    }
+    size_t GetHits()const { return hits; }
+    size_t GetMisses()const { return misses; }
+    size_t GetEvictions()const { return evictions; }
+    size_t GetBytes()const { return bytes; }
+private:
+    typedef std::list<std::pair<Key, Value>> List;
+    static size_t Size(const Key& key, const Value& value)
+    {
+        // the key is stored twice, plus the list node and the hash node
+        return 2 * sizeof(typename Key::value_type) * key.size() +
+            sizeof(typename Value::value_type) * value.size() + 4 * sizeof(void*) + 2 * sizeof(Key) + sizeof(Value);
+    }
+    List entries;
+    std::unordered_map<Key, typename List::iterator> index;
+    size_t max_bytes, bytes;
+    size_t hits, misses, evictions;
+};
+
+//! reads a file line by line in large blocks, the lines are handed out in place, without copying
+/*!
+    A line ends at '\n', a '\r' before it is dropped.
+    There is always one more line after the last '\n', even if it is empty, so an empty file has one empty line.
+    The file is read ahead of the lines which are handed out.
+    A terminal is read one line at a time, so that a line is processed as soon as it is typed.
+*/
+template<class CharType>
+class LineReader
+{
+public:
+    explicit LineReader(FILE* f, size_t block_size = 1 << 16)
+        : f(f), block_size(block_size), buffer(block_size + 1), begin(0), end(0), eof(false), done(false)
+    {
+#ifdef WIN32
+        interactive = _isatty(_fileno(f)) != 0;
+#else
+        interactive = isatty(fileno(f)) != 0;
+#endif
+    }
+    //! the next line is [line, line + length), also terminated by a zero, valid until the next call
+    /*!
+        Returns false if there are no more lines.
+    */
+    bool Next(const CharType*& line, size_t& length)
+    {
+        if (done)
+            return false;
+        size_t i = begin;
+        while (true)
+        {
+            i = std::find(buffer.data() + i, buffer.data() + end, CharType('\n')) - buffer.data();
+            if (i < end || eof)
+                break;
+            const size_t searched = i - begin;
+            Fill();
+            i = begin + searched;
+        }
+        // the last line
+        if (i == end)
+            done = true;
+        size_t last = i;
+        if (last > begin && buffer[last - 1] == CharType('\r'))
+            --last;
+        buffer[last] = CharType(0);
+        line = buffer.data() + begin;
+        length = last - begin;
+        begin = i + 1;
+        return true;
+    }
+private:
+    //! moves the unfinished line to the front and reads after it
+    void Fill()
+    {
+        std::copy(buffer.begin() + begin, buffer.begin() + end, buffer.begin());
+        end -= begin;
+        begin = 0;
+        // one more for the terminating zero
+        if (buffer.size() < end + block_size + 1)
+            buffer.resize(end + block_size + 1);
+        if (interactive)
+        {
+            CharType c;
+            while (end + 1 < buffer.size())
+            {
+                if (fread(&c, sizeof(CharType), 1, f) != 1)
+                {
+                    eof = true;
+                    break;
+                }
+                buffer[end++] = c;
+                if (c == CharType('\n'))
+                    break;
+            }
+        }
+        else
+        {
+            const size_t n = fread(buffer.data() + end, sizeof(CharType), block_size, f);
+            end += n;
+            eof = n < block_size;
+        }
+    }
+    FILE* f;
+    const size_t block_size;
+    std::vector<CharType> buffer;
+    //! the lines which are not handed out yet are in [begin, end)
+    size_t begin, end;
+    bool eof, done, interactive;
+};
+
 // https://stackoverflow.com/questions/25123458/is-trivially-copyable-is-not-a-member-of-std/31798726#31798726
 // workaround missing "is_trivially_copyable" in g++ < 5.0
 #if __GNUG__ && __GNUC__ < 5
@@ -178,32 +391,6 @@ public:
 #define IS_TRIVIALLY_COPYABLE(T) std::is_trivially_copyable<T>::value
 #endif
 
-template<class Type>
-bool ReadBinaryVector(FILE* f, std::vector<Type>& v)
-{
-    static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
-    v.clear();
-    size_t s;
-    if (fread(&s, sizeof(s), 1, f) != 1)
-        return false;
-    v.resize(s);
-    if (fread(v.data(), sizeof(Type), v.size(), f) != v.size())
-        return false;
-    return true;
-}
-
-template<class Type>
-bool WriteBinaryVector(FILE* f, const std::vector<Type>& v)
-{
-    static_assert(IS_TRIVIALLY_COPYABLE(Type), "");
-    const size_t s = v.size();
-    if (fwrite(&s, sizeof(s), 1, f) != 1)
-        return false;
-    if (fwrite(v.data(), sizeof(Type), v.size(), f) != v.size())
-        return false;
-    return true;
-}
-
 template<class StorageType>
 struct SignedBitfield
 {
@@ -67,9 +67,10 @@ try{
     }
     fclose(f);
 
-    t.max_depth = max_depth;
-    t.max_results = max_results;
-    t.time_limit = time_limit;
+    decltype(t)::LookupContext ctx;
+    ctx.max_depth = max_depth;
+    ctx.max_results = max_results;
+    ctx.time_limit = time_limit;
 
     auto lookup = &decltype(t)::Lookup<attol::OBEY, false>;
     switch (flag_strategy)
@@ -83,7 +84,7 @@ try{
     }
     std::string word;
     char c;
-    t.resulthandler = [&word](const decltype(t)::Path& path)
+    ctx.resulthandler = [&word](const decltype(t)::Path& path)
     {
         fputs(word.c_str(), stdout);
         fputc('\t', stdout);
@@ -100,7 +101,7 @@ try{
         {
             word.push_back(c);
         }
-        (t.*lookup)(word.data());
+        (t.*lookup)(ctx, word.data());
         fputc('\n', stdout);
     }
     return 0;
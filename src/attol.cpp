@@ -1,11 +1,16 @@
 #include <iostream>
 #include <stdio.h>
 #include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <algorithm>
 
 #include "ArgParser.h"
 #include "attol/Transducer.h"
 #include "attol/Char.h"
 #include "attol/Print.h"
+#include "attol/Parallel.h"
 
 #ifdef WIN32
 # include <io.h>
@@ -28,9 +33,361 @@ void SetBinary()
 double time_limit = 0.0;
 size_t max_depth = 0, max_results = 0;
 int print_type = 305;
-bool bom = false, binary_input = false, binary_output = false;
+bool bom = false, binary_input = false, binary_output = false, best_first = false, dead_end_memo = false;
 std::string dump_filename;
 size_t field_separator = '\t';
+size_t n_threads = 1;
+//! in megabytes, shared among the threads
+size_t cache_size = 0;
+//! number of words handed to a thread at once
+const size_t batch_size = 256;
+//! the same, but with --batch, because the longer the batch the more common prefixes there are
+const size_t trie_batch_size = 4096;
+bool trie_batch = false;
+bool reorder_states = false;
+//! the binary transducer is used in place, where the file is mapped into the memory
+bool map_input = false;
+//! the transducer is a shared image, and where to publish one
+bool map_shared = false;
+std::string shared_filename;
+//! where the transition hits are written to, and where they are read from to reorder the states
+std::string profile_filename, order_filename;
+
+//! one count per line, in the order of the transition IDs
+void WriteProfile(const std::string& filename, const std::vector<size_t>& transition_hits)
+{
+    FILE* f = fopen(filename.c_str(), "w");
+    if (!f)
+        throw attol::Error("Cannot open \"", filename, "\" for writing!");
+    for (const auto hits : transition_hits)
+        if (fprintf(f, "%llu\n", (unsigned long long)hits) < 0)
+            throw attol::Error("Cannot write profile into \"", filename, "\"!");
+    fclose(f);
+}
+
+std::vector<size_t> ReadProfile(const std::string& filename)
+{
+    FILE* f = fopen(filename.c_str(), "r");
+    if (!f)
+        throw attol::Error("Cannot open \"", filename, "\"!");
+    std::vector<size_t> transition_hits;
+    unsigned long long hits;
+    while (fscanf(f, "%llu", &hits) == 1)
+        transition_hits.push_back(size_t(hits));
+    const bool complete = feof(f) != 0;
+    fclose(f);
+    if (!complete)
+        throw attol::Error("Profile \"", filename, "\" is invalid at line ", transition_hits.size() + 1, "!");
+    return transition_hits;
+}
+
+template<class CharType>
+bool ReadWord(attol::LineReader<CharType>& input, std::basic_string<CharType>& word)
+{
+    const CharType* line;
+    size_t length;
+    if (!input.Next(line, length))
+        return false;
+    word.assign(line, length);
+    return true;
+}
+
+//! the --print masks without a compiled PrintSink are printed with this
+const int dynamic_print = std::numeric_limits<int>::min();
+
+//! what the results are printed with
+template<attol::Encoding enc, attol::Layout layout, int print>
+struct Sink
+{
+    typedef attol::PrintSink<enc, 32, print, layout> type;
+};
+
+template<attol::Encoding enc, attol::Layout layout>
+struct Sink<enc, layout, dynamic_print>
+{
+    typedef std::function<void(const typename attol::Transducer<enc, 32, layout>::Path&)> type;
+};
+
+//! looks up words and prints the results, one per thread
+template<attol::Encoding enc, attol::Layout layout, attol::FlagStrategy strategy, int print>
+class Analyzer
+{
+public:
+    typedef attol::Transducer<enc, 32, layout> Transducer;
+    typedef typename Transducer::CharType CharType;
+    typedef std::basic_string<CharType> string;
+
+    Analyzer(const Transducer& t, size_t cache_bytes)
+        : t(t), printf(print_type), sink(MakeSink(printf)), cache(cache_bytes)
+    {
+        ctx.max_depth = max_depth;
+        ctx.max_results = max_results;
+        ctx.time_limit = time_limit;
+        ctx.dead_end_memo = dead_end_memo;
+        ctx.profile = !profile_filename.empty();
+        ctx.resulthandler = printf.GetF();
+    }
+    //! returns everything that has to be printed about a word
+    const string& operator()(const string& word)
+    {
+        if (const auto cached = cache.Find(word))
+            return *cached;
+        printf.Reset(word.c_str());
+        if (best_first)
+            t.template LookupBest<strategy, true>(ctx, word.c_str(), sink);
+        else
+            t.template Lookup<strategy, true>(ctx, word.c_str(), sink);
+        auto& output = Finish();
+        // an interrupted search could turn out differently next time
+        if (!ctx.TimedOut())
+            cache.Insert(word, output);
+        return output;
+    }
+    //! appends everything that has to be printed about the words
+    void operator()(const std::vector<string>& words, string& result)
+    {
+        // the profile is counted by the depth-first search, word by word
+        // and the time limit is for every word, not shared in a batch
+        if (!trie_batch || best_first || ctx.profile || time_limit > 0)
+        {
+            for (const auto& word : words)
+                result += (*this)(word);
+            return;
+        }
+        // the cached words are left out of the batch
+        outputs.resize(words.size());
+        batch.clear();
+        batch_words.clear();
+        for (size_t i = 0; i < words.size(); ++i)
+        {
+            if (const auto cached = cache.Find(words[i]))
+                outputs[i] = *cached;
+            else
+            {
+                batch.emplace_back(i);
+                batch_words.emplace_back(words[i].c_str());
+            }
+        }
+        // the paths are printed as they are found, into the output of their word
+        word_states.resize(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            printf.Swap(word_states[i]);
+            printf.Reset(words[batch[i]].c_str());
+            printf.Swap(word_states[i]);
+        }
+        const size_t none = std::numeric_limits<size_t>::max();
+        size_t current = none;
+        ctx.resulthandler = [this, &current, none](const typename Transducer::Path& path)
+        {
+            if (ctx.GetWord() != current)
+            {
+                if (current != none)
+                    printf.Swap(word_states[current]);
+                current = ctx.GetWord();
+                printf.Swap(word_states[current]);
+            }
+            sink(path);
+        };
+        t.template LookupBatch<strategy, true>(ctx, batch_words);
+        ctx.resulthandler = printf.GetF();
+        if (current != none)
+            printf.Swap(word_states[current]);
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            printf.Swap(word_states[i]);
+            outputs[batch[i]].swap(Finish());
+            printf.Swap(word_states[i]);
+            if (!ctx.TimedOut())
+                cache.Insert(words[batch[i]], outputs[batch[i]]);
+        }
+        for (const auto& output : outputs)
+            result += output;
+    }
+    const typename Transducer::LookupContext& GetContext()const { return ctx; }
+    const attol::LruCache<string, string>& GetCache()const { return cache; }
+private:
+    typedef typename Sink<enc, layout, print>::type SinkType;
+    template<class PrintFunction>
+    static SinkType MakeSink(PrintFunction& printf)
+    {
+        return MakeSink(printf, std::integral_constant<bool, print == dynamic_print>());
+    }
+    template<class PrintFunction>
+    static SinkType MakeSink(PrintFunction& printf, std::true_type)
+    {
+        return printf.GetF();
+    }
+    template<class PrintFunction>
+    static SinkType MakeSink(PrintFunction& printf, std::false_type)
+    {
+        return SinkType(printf);
+    }
+    //! completes the output of a word
+    string& Finish()
+    {
+        auto& output = printf.GetOutput();
+        if (!printf.Succeeded())
+        {
+            output.push_back(CharType('?'));
+            output.push_back(CharType('\n'));
+        }
+        output.push_back(CharType('\n'));
+        return output;
+    }
+    const Transducer& t;
+    attol::PrintFunction<enc, 32, layout> printf;
+    SinkType sink;
+    typename Transducer::LookupContext ctx;
+    attol::LruCache<string, string> cache;
+    // for the trie batches
+    std::vector<string> outputs;
+    std::vector<size_t> batch;
+    std::vector<const CharType*> batch_words;
+    std::vector<typename attol::PrintFunction<enc, 32, layout>::WordState> word_states;
+};
+
+template<attol::Encoding enc, attol::Layout layout, attol::FlagStrategy strategy, int print>
+void analyze(const attol::Transducer<enc, 32, layout>& t, FILE* input_file, FILE* output)
+{
+    typedef typename attol::Transducer<enc, 32, layout>::CharType CharType;
+    typedef Analyzer<enc, layout, strategy, print> AnalyzerType;
+    typedef std::basic_string<CharType> string;
+    attol::LineReader<CharType> input(input_file);
+    std::vector<std::unique_ptr<AnalyzerType>> analyzers;
+    for (size_t i = 0; i < n_threads; ++i)
+        // the repeated words count in the profile as well
+        analyzers.emplace_back(new AnalyzerType(t, profile_filename.empty() ? (cache_size << 20) / n_threads : 0));
+    const size_t words_per_job = trie_batch ? trie_batch_size : batch_size;
+    if (n_threads == 1 && trie_batch)
+    {
+        AnalyzerType& analyzer = *analyzers.front();
+        std::vector<string> words;
+        string result;
+        for (size_t n = words_per_job; n == words_per_job; )
+        {
+            words.resize(words_per_job);
+            for (n = 0; n < words.size() && ReadWord(input, words[n]); ++n);
+            words.resize(n);
+            result.clear();
+            analyzer(words, result);
+            fwrite(result.data(), sizeof(CharType), result.size(), output);
+        }
+    }
+    else if (n_threads == 1)
+    {
+        AnalyzerType& analyzer = *analyzers.front();
+        string word;
+        while (ReadWord(input, word))
+        {
+            const auto& result = analyzer(word);
+            fwrite(result.data(), sizeof(CharType), result.size(), output);
+        }
+    }
+    else
+    {
+
+        attol::OrderedParallel<std::vector<string>, string>(n_threads, 4 * n_threads,
+            [&input, words_per_job](std::vector<string>& words)
+            {
+                words.resize(words_per_job);
+                size_t n = 0;
+                while (n < words.size() && ReadWord(input, words[n]))
+                    ++n;
+                words.resize(n);
+                return n > 0;
+            },
+            [&analyzers](size_t thread, std::vector<string>& words, string& result)
+            {
+                (*analyzers[thread])(words, result);
+            },
+            [&output](string& result)
+            {
+                fwrite(result.data(), sizeof(CharType), result.size(), output);
+            });
+    }
+    if (dead_end_memo && !best_first)
+    {
+        size_t hits = 0, dead_ends = 0;
+        for (const auto& analyzer : analyzers)
+        {
+            hits += analyzer->GetContext().GetDeadEndHits();
+            dead_ends += analyzer->GetContext().GetDeadEnds();
+        }
+        std::cerr << "Dead ends memorized: " << dead_ends << "\nRevisits saved: " << hits << std::endl;
+    }
+    if (!profile_filename.empty())
+    {
+        std::vector<size_t> transition_hits(t.GetNumberOfTransitions(), 0);
+        for (const auto& analyzer : analyzers)
+        {
+            const auto& hits = analyzer->GetContext().GetTransitionHits();
+            for (size_t i = 0; i < hits.size(); ++i)
+                transition_hits[i] += hits[i];
+        }
+        WriteProfile(profile_filename, transition_hits);
+    }
+    if (cache_size > 0 && profile_filename.empty())
+    {
+        size_t hits = 0, misses = 0, evictions = 0;
+        for (const auto& analyzer : analyzers)
+        {
+            hits += analyzer->GetCache().GetHits();
+            misses += analyzer->GetCache().GetMisses();
+            evictions += analyzer->GetCache().GetEvictions();
+        }
+        std::cerr << "Cache hits: " << hits << "\nCache misses: " << misses << "\nCache evictions: " << evictions << std::endl;
+    }
+}
+
+//! every other encoding is printed with the handlers, to save on compile time
+template<attol::Encoding enc, attol::Layout layout, attol::FlagStrategy strategy>
+void dispatch_print(const attol::Transducer<enc, 32, layout>& t, FILE* input, FILE* output, std::false_type)
+{
+    analyze<enc, layout, strategy, dynamic_print>(t, input, output);
+}
+
+//! the default and the most common masks without relative weights have their own instantiation in UTF-8
+template<attol::Encoding enc, attol::Layout layout, attol::FlagStrategy strategy>
+void dispatch_print(const attol::Transducer<enc, 32, layout>& t, FILE* input, FILE* output, std::true_type)
+{
+    switch (print_type)
+    {
+    case 17:
+        return analyze<enc, layout, strategy, 17>(t, input, output);
+    case 49:
+        return analyze<enc, layout, strategy, 49>(t, input, output);
+    case 273:
+        return analyze<enc, layout, strategy, 273>(t, input, output);
+    case 305:
+        return analyze<enc, layout, strategy, 305>(t, input, output);
+    default:
+        return analyze<enc, layout, strategy, dynamic_print>(t, input, output);
+    }
+}
+
+//! every other encoding keeps the weights, to save on compile time
+template<attol::Encoding enc, attol::FlagStrategy strategy>
+void dispatch_weights(attol::Transducer<enc, 32>& t, FILE* input, FILE* output, std::false_type)
+{
+    dispatch_print<enc, attol::ARRAY_OF_STRUCTS, strategy>(t, input, output, std::false_type());
+}
+
+//! an UTF-8 transducer without weights is looked up without loading the weights
+/*!
+    Unless it is mapped, that would copy the transitions out of the shared memory.
+*/
+template<attol::Encoding enc, attol::FlagStrategy strategy>
+void dispatch_weights(attol::Transducer<enc, 32>& t, FILE* input, FILE* output, std::true_type)
+{
+    if (t.IsMapped() || t.HasWeights())
+        return dispatch_print<enc, attol::ARRAY_OF_STRUCTS, strategy>(t, input, output, std::true_type());
+    attol::Transducer<enc, 32, attol::UNWEIGHTED> unweighted;
+    unweighted.Assign(t);
+    t = attol::Transducer<enc, 32>();
+    std::cerr << "No weights, memory (bytes): " << unweighted.GetAllocatedMemory() << std::endl;
+    dispatch_print<enc, attol::UNWEIGHTED, strategy>(unweighted, input, output, std::true_type());
+}
 
 template<attol::Encoding enc, attol::FlagStrategy strategy>
 void do_main(std::string transducer_filename, FILE* input, FILE* output)
@@ -38,7 +395,26 @@ void do_main(std::string transducer_filename, FILE* input, FILE* output)
     typedef attol::Transducer<enc, 32> Transducer;
     typedef typename Transducer::CharType CharType;
 
+    if (n_threads == 0)
+        n_threads = std::max<size_t>(1, std::thread::hardware_concurrency());
+
     Transducer t;
+    if (map_shared)
+    {
+        std::cerr << "Mapping shared transducer \"" << transducer_filename << "\" ... " << std::endl;
+        if (!t.MapShared(transducer_filename))
+            throw attol::Error("Shared image \"", transducer_filename, "\" is an invalid transducer!");
+        std::cerr << "Generation: " << t.GetGeneration() << std::endl;
+    }
+    else if (map_input)
+    {
+        std::cerr << "Mapping transducer \"" << transducer_filename << "\" ... " << std::endl;
+        const auto file = std::make_shared<const attol::MappedFile>(transducer_filename);
+        if (!t.MapBinary(file))
+            throw attol::Error("Binary file \"", transducer_filename, "\" is an invalid transducer!");
+        std::cerr << "Mapped (bytes): " << file->GetSize() << std::endl;
+    }
+    else
     {
         FILE* f = fopen(transducer_filename.c_str(), "rb");
         if (!f)
@@ -54,12 +430,16 @@ void do_main(std::string transducer_filename, FILE* input, FILE* output)
         {
             if (bom && !attol::CheckBom<enc>(f))
                 throw attol::Error("File \"", transducer_filename, "\" with encoding ", int(enc), " does not match BOM!");
-            t.Read(f, CharType(field_separator));
+            t.Read(f, CharType(field_separator), n_threads);
             std::cerr << "States: " << t.GetNumberOfStates() <<
                 "\nTransitions: " << t.GetNumberOfTransitions() << std::endl;
         }
         fclose(f);
     }
+    if (!order_filename.empty())
+        t.ReorderStates(t.GetFrequencyOrder(ReadProfile(order_filename)));
+    else if (reorder_states)
+        t.ReorderStates(t.GetBreadthFirstOrder());
     if (!dump_filename.empty())
     {
         FILE* f = fopen(dump_filename.c_str(), "wb");
@@ -72,41 +452,19 @@ void do_main(std::string transducer_filename, FILE* input, FILE* output)
         fclose(f);
         std::cerr << "done" << std::endl;
     }
+    if (!shared_filename.empty())
+    {
+        std::cerr << "Publishing transducer \"" << shared_filename << "\" ... ";
+        std::cerr.flush();
+        std::cerr << "generation " << t.WriteShared(shared_filename) << std::endl;
+    }
 
     if (bom && !attol::CheckBom<enc>(input))
         throw attol::Error("Input file with encoding ", int(enc), " does not match BOM!");
     if (bom && !attol::WriteBom<enc>(output))
         throw attol::Error("Cannot write BOM to output with encoding", int(enc), "!");
 
-    t.max_depth = max_depth;
-    t.max_results = max_results;
-    t.time_limit = time_limit;
-
-    attol::PrintFunction<enc, 32> printf(print_type, output);
-    t.resulthandler = printf.GetF();
-    std::basic_string<typename Transducer::CharType> word;
-    CharType c;
-    while (!feof(input))
-    {
-        word.clear();
-        while (fread(&c, sizeof(c), 1, input) == 1 && c != '\n')
-        {
-            word.push_back(c);
-        }
-        if (!word.empty() && word.back() == '\r')
-            word.pop_back();
-        printf.Reset(word.c_str());
-        t.template Lookup<strategy, true>(word.c_str());
-        if (!printf.Succeeded())
-        {
-            c = '?';
-            fwrite(&c, sizeof(c), 1, output);
-            c = '\n';
-            fwrite(&c, sizeof(c), 1, output);
-        }
-        c = '\n';
-        fwrite(&c, sizeof(c), 1, output);
-    }
+    return dispatch_weights<enc, strategy>(t, input, output, std::integral_constant<bool, enc == attol::UTF8>());
 }
 
 int main(int argc, const char** argv)
@@ -141,6 +499,12 @@ int main(int argc, const char** argv)
                         "AT&T (text) format transducer filename", "filename");
         parser.AddFlag(binary_input, { "-bi", "--binary-input" },
             "Read the transducer in a binary format");
+        parser.AddFlag(map_input, { "-mi", "--map-input" },
+            "Map the binary transducer into memory instead of reading it, implies -bi.\n"
+            "The processes which map the same file share its memory and nothing is loaded up front.");
+        parser.AddFlag(map_shared, { "-ms", "--map-shared" },
+            "The transducer is a shared image written by -ws, map it like -mi.\n"
+            "It is a file, or a POSIX shared memory object if it is named like /name.");
 
         parser.AddArg(input_filename, { "-i", "--input" },
                         "input file to analyze, stdin if empty", "filename");
@@ -152,6 +516,23 @@ int main(int argc, const char** argv)
             "Don't convert the transducer if this argument is empty.", "filename");
         parser.AddFlag(binary_output, { "-bo", "--binary-output" },
             "Write the transducer in a binary format");
+        parser.AddArg(shared_filename, { "-ws", "--write-shared" },
+            "Publish the transducer after loading as a shared image for -ms, "
+            "a file or a POSIX shared memory object named like /name.\n"
+            "An image under the same name is replaced by the next generation, "
+            "the processes which have it mapped keep the old one.", "filename");
+        parser.AddFlag(reorder_states, { "-r", "--reorder" },
+            "Number the states breadth first from the start state after loading, "
+            "so that the states which are searched one after the other are close in memory.\n"
+            "Only the transition IDs (--print 64) change, the transducer is written reordered.");
+        parser.AddArg(order_filename, { "-ro", "--reorder-by" },
+            "Number the states by a profile of the same transducer after loading, "
+            "the most frequently entered states first, instead of -r.\n"
+            "Like with -r, only the transition IDs change and the transducer is written reordered.", "filename");
+        parser.AddArg(profile_filename, { "-pr", "--profile" },
+            "Count how many times each transition is followed during the analysis "
+            "and write the counts into this file, one line per transition ID.\n"
+            "The words are looked up one by one, without --batch and --cache. Cannot be used with -bf.", "filename");
 
         parser.AddArg(time_limit, { "-t", "--time" }, 
                         "time limit (in seconds) when not to search further\n"
@@ -159,9 +540,30 @@ int main(int argc, const char** argv)
         parser.AddArg(max_results, { "-n" },
                         "max number of results for one word\n"
                         "unlimited if set to 0");
+        parser.AddFlag(best_first, { "-bf", "--best-first" },
+                        "Report the analyses in increasing order of weight, "
+                        "with -n only the lowest weight ones are searched for.\n"
+                        "The order is exact unless the transducer has a cycle of negative total weight.");
+        parser.AddFlag(trie_batch, { "-b", "--batch" },
+                        "Look up the words in batches, common prefixes of the words in a batch are searched only once.\n"
+                        "Pays off if the input is sorted, the output is the same.\n"
+                        "The words are looked up one by one if there is a time limit (-t).");
+        parser.AddFlag(dead_end_memo, { "-m", "--memo" },
+                        "Remember which (state, input position, flag state) configurations lead to no analysis "
+                        "and do not search them again within a word.\n"
+                        "Helps if many epsilon or flag diacritic paths meet, the output is the same.");
         parser.AddArg(max_depth, { "-d", "--depth" },
                         "maximum depth to go down during lookup\n"
                         "unlimited if set to 0");
+        parser.AddArg(n_threads, { "-j", "--jobs" },
+                        "number of threads to read the AT&T file and to analyze with,\n"
+                        "the transducer and the output are the same as with one thread\n"
+                        "as many as the hardware supports if set to 0");
+        
+        parser.AddArg(cache_size, { "-c", "--cache" },
+                        "Memory (in megabytes) in which the output of the most recently analyzed words is remembered.\n"
+                        "The output is the same, but repeated words are not looked up again.\n"
+                        "no caching if set to 0");
         
         parser.AddArg(field_separator, { "-fs", "--fs", "--tab", "-ts", "--ts" },
             "field separator, character between columns of transducer file\n"
@@ -216,6 +618,8 @@ int main(int argc, const char** argv)
 try{
     std::ios_base::sync_with_stdio(false);
     SetBinary();
+    if (!profile_filename.empty() && best_first)
+        throw attol::Error("The profile is counted by the depth-first search, it cannot be used with -bf!");
     
     FILE* input = input_filename.empty() ? stdin : fopen(input_filename.c_str(), "rb");
     if (!input)